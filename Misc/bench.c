@@ -0,0 +1,238 @@
+/*
+ * bench.c
+ * Copyright (c) Kyle Won, 2021
+ * Throughput benchmark of the CPME linear transformation kernels and integrity checks. Not a test,
+ * only prints timings.
+ * Build with "make bench" and run ./cpme_bench.
+ */
+// Define POSIX source for clock_gettime
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../cpme.h"
+#include "../kernels.h"
+
+// Bytes transformed per measurement, larger than the caches so data streams from memory
+#define BENCH_BYTES (64 * 1024 * 1024)
+// Times every measurement is repeated, the fastest is reported
+#define BENCH_RUNS 3
+// Fixed dimensions measured after the variable dimensions
+#define NUM_FIXED_DIMENSIONS 4
+static const int fixed_dimensions[NUM_FIXED_DIMENSIONS] = {1000, 1024, 2048, 4096};
+
+// State of the xorshift generator filling the benchmark's data and matrices
+static uint64_t bench_state = 0x2545F4914F6CDD1DULL;
+
+/*
+ * Returns the next value of the benchmark's pseudo random sequence.
+ */
+static uint64_t bench_random() {
+  bench_state ^= bench_state << 13;
+  bench_state ^= bench_state >> 7;
+  bench_state ^= bench_state << 17;
+  return bench_state;
+}
+
+/*
+ * Returns a uniformly shuffled permutation matrix of the given dimension.
+ */
+static struct PMAT *bench_mat(int dimension) {
+  struct PMAT *m = init_permut_mat(dimension);
+  for(int i = 0; i < dimension; i++) {
+    m->index[i] = (pmat_index)i;
+  }
+  for(int i = dimension - 1; i > 0; i--) {
+    int j = (int)(bench_random() % (uint64_t)(i + 1));
+    pmat_index swap = m->index[i];
+    m->index[i] = m->index[j];
+    m->index[j] = swap;
+  }
+  return m;
+}
+
+/*
+ * Returns the seconds elapsed since the given time.
+ */
+static double bench_seconds(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) + (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Transforms every whole chunk of the data with the matrix the way permut_cipher() does, through a
+ * scratch copy, and returns the fastest throughput in GB/s.
+ */
+static double bench_transform(unsigned char *data, unsigned char *scratch, struct PMAT *m,
+                              integrity_mode integrity_check) {
+  int dimension = m->dimension;
+  long num_chunks = BENCH_BYTES / dimension;
+  double best = 0;
+  for(int run = 0; run < BENCH_RUNS; run++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long chunk = 0; chunk < num_chunks; chunk++) {
+      unsigned char *cur = data + chunk * dimension;
+      memcpy(scratch, cur, (size_t)dimension);
+      if(!transform_vec(dimension, cur, scratch, m, integrity_check)) {
+        fatal(LOG_OUTPUT, "Integrity check failed in bench_transform(), bench.c.");
+      }
+    }
+    double rate = (double)(num_chunks * dimension) / bench_seconds(&start) / 1e9;
+    best = rate > best ? rate : best;
+  }
+  return best;
+}
+
+/*
+ * Stores the smallest index of every cycle of the matrix's permutation in leaders. Returns the
+ * number of cycles.
+ */
+static int bench_cycle_leaders(struct PMAT *m, pmat_index leaders[]) {
+  unsigned char seen[MAX_DIMENSION] = {0};
+  int num_cycles = 0;
+  for(int i = 0; i < m->dimension; i++) {
+    if(!seen[i]) {
+      leaders[num_cycles++] = (pmat_index)i;
+      for(int j = i; !seen[j]; j = m->index[j]) {
+        seen[j] = 1;
+      }
+    }
+  }
+  return num_cycles;
+}
+
+/*
+ * Transforms every whole chunk of the data in place by following the cycles of the matrix with a
+ * single temporary byte, and returns the fastest throughput in GB/s. Checks the first chunk against
+ * the kernel through a scratch copy.
+ */
+static double bench_in_place(unsigned char *data, unsigned char *scratch, struct PMAT *m) {
+  int dimension = m->dimension;
+  long num_chunks = BENCH_BYTES / dimension;
+  pmat_index leaders[MAX_DIMENSION];
+  int num_cycles = bench_cycle_leaders(m, leaders);
+  unsigned char expected[MAX_DIMENSION];
+  memcpy(scratch, data, (size_t)dimension);
+  permute_bytes(expected, scratch, m);
+  double best = 0;
+  for(int run = 0; run < BENCH_RUNS; run++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long chunk = 0; chunk < num_chunks; chunk++) {
+      unsigned char *cur = data + chunk * dimension;
+      for(int k = 0; k < num_cycles; k++) {
+        int first = leaders[k];
+        unsigned char first_byte = cur[first];
+        int j = first;
+        for(int next = m->index[j]; next != first; next = m->index[j]) {
+          cur[j] = cur[next];
+          j = next;
+        }
+        cur[j] = first_byte;
+      }
+    }
+    double rate = (double)(num_chunks * dimension) / bench_seconds(&start) / 1e9;
+    best = rate > best ? rate : best;
+    if(run == 0 && memcmp(expected, data, (size_t)dimension) != 0) {
+      fatal(LOG_OUTPUT, "In place output differs from the kernel in bench_in_place(), bench.c.");
+    }
+  }
+  return best;
+}
+
+/*
+ * Returns the dimension of the given row of the benchmark tables. The variable dimensions, starting
+ * with the standard one, then the fixed dimensions.
+ */
+static int bench_dimension(int row) {
+  return row < 9 ? variable_dimension(row + 1) : fixed_dimensions[row - 9];
+}
+
+/*
+ * Checks the matrix's kernel permutes like the generic scalar kernel.
+ */
+static void bench_verify(unsigned char *scratch, struct PMAT *m) {
+  unsigned char expected[MAX_DIMENSION];
+  unsigned char actual[MAX_DIMENSION];
+  permute_scalar(m->dimension, expected, scratch, m->index);
+  m->permute(m->dimension, actual, scratch, m->index);
+  if(memcmp(expected, actual, (size_t)m->dimension) != 0) {
+    fatal(LOG_OUTPUT, "Kernel output differs from the scalar kernel in bench_verify(), bench.c.");
+  }
+}
+
+int main() {
+  unsigned char *data = (unsigned char *)malloc(BENCH_BYTES);
+  // Kernels may read past the chunk
+  unsigned char *scratch = (unsigned char *)calloc(MAX_DIMENSION + KERNEL_PADDING, sizeof(unsigned char));
+  if(!data || !scratch) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in main(), bench.c."); exit(EXIT_FAILURE);
+  }
+  for(long i = 0; i < BENCH_BYTES; i++) {
+    data[i] = (unsigned char)bench_random();
+  }
+  init_byte_hashes();
+  init_kernels();
+  int num_rows = 9 + NUM_FIXED_DIMENSIONS;
+  struct PMAT *mats[9 + NUM_FIXED_DIMENSIONS];
+  for(int row = 0; row < num_rows; row++) {
+    mats[row] = bench_mat(bench_dimension(row));
+  }
+  printf("Linear transformation throughput (GB/s), %d MiB per run, best of %d\n\n",
+         BENCH_BYTES / (1024 * 1024), BENCH_RUNS);
+  // Every kernel the CPU supports, without integrity checks
+  permute_kernel *chosen = active_kernel;
+  printf("%-10s", "Dimension");
+  for(int i = 0; i < num_permute_kernels; i++) {
+    if(permute_kernels[i].supported()) {
+      printf(" %10s", permute_kernels[i].name);
+    }
+  }
+  printf("\n");
+  for(int row = 0; row < num_rows; row++) {
+    struct PMAT *m = mats[row];
+    printf("%-10d", m->dimension);
+    for(int i = 0; i < num_permute_kernels; i++) {
+      if(permute_kernels[i].supported()) {
+        m->permute = permute_kernels[i].permute;
+        bench_verify(scratch, m);
+        printf(" %10.2f", bench_transform(data, scratch, m, CHECK_NONE));
+      }
+    }
+    printf("\n");
+    m->permute = chosen->permute;
+  }
+  // Scratch copy against in place cycle following. Per chunk byte, the scratch copy reads the chunk,
+  // writes and reads the scratch, reads the index and writes the chunk. In place skips the scratch
+  int scratch_traffic = 4 + (int)sizeof(pmat_index);
+  int in_place_traffic = 2 + (int)sizeof(pmat_index);
+  // Only the data rates are measured, the memory rates are estimated from the bytes touched
+  printf("\nScratch copy against in place cycle following (GB/s). Data rates are measured. Estimated memory\n"
+         "rates are the data rate times the bytes touched per chunk byte: %d for the scratch copy (chunk\n"
+         "read and write, scratch write and read, %d byte index), %d in place (chunk read and write, index)\n",
+         scratch_traffic, (int)sizeof(pmat_index), in_place_traffic);
+  printf("%-10s %10s %10s %12s %12s\n", "Dimension", "Scratch", "In place", "Scratch", "In place");
+  printf("%-10s %10s %10s %12s %12s\n", "", "data", "data", "est. memory", "est. memory");
+  for(int row = 0; row < num_rows; row++) {
+    double scratch_rate = bench_transform(data, scratch, mats[row], CHECK_NONE);
+    double in_place_rate = bench_in_place(data, scratch, mats[row]);
+    printf("%-10d %10.2f %10.2f %12.2f %12.2f\n", mats[row]->dimension, scratch_rate, in_place_rate,
+           scratch_rate * scratch_traffic, in_place_rate * in_place_traffic);
+  }
+  // Integrity checks, with the kernel chosen for the CPU
+  printf("\n%-10s %10s %10s %10s   (%s kernel)\n", "Dimension", "No check", "Multiset", "Dot",
+         active_kernel->name);
+  for(int row = 0; row < num_rows; row++) {
+    double none = bench_transform(data, scratch, mats[row], CHECK_NONE);
+    double multiset = bench_transform(data, scratch, mats[row], CHECK_MULTISET);
+    double dot = bench_transform(data, scratch, mats[row], CHECK_DOT);
+    printf("%-10d %10.2f %10.2f %10.2f\n", mats[row]->dimension, none, multiset, dot);
+    purge_mat(mats[row]);
+  }
+  free(data);
+  free(scratch);
+  return 0;
+}
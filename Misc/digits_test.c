@@ -0,0 +1,112 @@
+/*
+ * digits_test.c
+ * Copyright (c) Kyle Won, 2021
+ * Checks the key digit strings of gen_log_base_digits() and gen_linked_vals() against the original
+ * digits, formatted with sprintf("%.16lf") and cut after the decimal point, for many keys and
+ * dimensions. Exits with a failure status on the first difference.
+ * Build and run with "make test".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "../cpme.h"
+
+// Every key value below this is checked against every log base below DIGITS_MAX_BASE
+#define DIGITS_MAX_KEY 1000
+#define DIGITS_MAX_BASE 5000
+// Random key values and log bases checked over their whole ranges
+#define DIGITS_RANDOM_CASES 2000000
+
+// State of the xorshift generator picking the random cases
+static uint64_t digits_state = 0x9E3779B97F4A7C15ULL;
+
+/*
+ * Returns the next value of the test's pseudo random sequence.
+ */
+static uint64_t digits_random() {
+  digits_state ^= digits_state << 13;
+  digits_state ^= digits_state >> 7;
+  digits_state ^= digits_state << 17;
+  return digits_state;
+}
+
+/*
+ * Writes the 15 digits the original implementation took from log(key) / log(log_base) to dest.
+ */
+static void original_digits(int key_val, double log_base, char *dest) {
+  double output = log(key_val) / log(log_base);
+  char log_base_str[BUFFER];
+  sprintf(log_base_str, "%.16lf", output);
+  //gets rid of everything before the decimal
+  char *ch = log_base_str;
+  while(*ch != '.') {
+    ch++;
+  }
+  ch++;
+  strncpy(dest, ch, (size_t)15);
+  dest[15] = '\0';
+}
+
+/*
+ * Compares the digits of one key value and log base. Exits with a failure status if they differ.
+ */
+static void check_digits(int key_val, double log_base) {
+  char expected[16];
+  char actual[16];
+  original_digits(key_val, log_base, expected);
+  gen_log_base_digits(log(key_val), log_base, actual);
+  actual[15] = '\0';
+  if(strcmp(expected, actual) != 0) {
+    printf("Digits differ for key %d, log base %.0lf: expected %s, got %s\n", key_val, log_base,
+           expected, actual);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Compares the digit string of a key value and length with the original segments concatenated.
+ * Exits with a failure status if they differ.
+ */
+static void check_linked_vals(int key_val, int length) {
+  char *linked = gen_linked_vals(key_val, length);
+  int sequences = 1;
+  if(length > 15) {
+    sequences = ((length - (length % 15)) / 15) + 1;
+  }
+  for(int i = 0; i < sequences; i++) {
+    char expected[16];
+    //original log bases ran from 2 + length
+    original_digits(key_val, (double)(i + 2 + length), expected);
+    if(strncmp(expected, linked + 15 * i, 15) != 0) {
+      printf("Digit string differs for key %d, length %d at segment %d\n", key_val, length, i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(linked);
+}
+
+int main() {
+  long cases = 0;
+  for(int key_val = 1; key_val < DIGITS_MAX_KEY; key_val++) {
+    for(int log_base = 2; log_base < DIGITS_MAX_BASE; log_base++) {
+      check_digits(key_val, (double)log_base);
+      cases++;
+    }
+  }
+  for(long i = 0; i < DIGITS_RANDOM_CASES; i++) {
+    int key_val = (int)(digits_random() % INT_MAX) + 1;
+    // Dimension digit strings use bases up to 2 * MAX_DIMENSION, variable ones the file length
+    double log_base = (double)(digits_random() % (i % 2 ? 2 * MAX_DIMENSION : 1L << 40) + 2);
+    check_digits(key_val, log_base);
+    cases++;
+  }
+  // Whole digit strings of the matrices of every dimension
+  for(int dimension = 1; dimension <= MAX_DIMENSION; dimension++) {
+    check_linked_vals((int)(digits_random() % INT_MAX) + 1, 2 * dimension);
+    cases++;
+  }
+  printf("Key digits match the original implementation in %ld cases\n", cases);
+  return 0;
+}
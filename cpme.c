@@ -4,89 +4,90 @@
  * CPME core.
  */
 
+// Define POSIX source for pread and pwrite
+#define _XOPEN_SOURCE 700
 #include "cpme.h"
+#include "kernels.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <math.h>
 #include <time.h>
-#include <semaphore.h>
 #include <pthread.h>
-#include "cpme.h"
-#include "Dependencies/st_to_cc.h"
-#include "Dependencies/csparse.h"
+#include <stdint.h>
+#include <limits.h>
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 uint128;
+#endif
 
+// Timers summed by the pool threads, added to atomically
 clock_t time_total_gen;
 clock_t time_total_write;
 clock_t time_transformation;
 clock_t time_p_loop;
+// Bytes of uniform chunks left untransformed, a permutation of them is the chunk itself
+long bytes_skipped;
+// Random value of every byte value, summed by multiset_hash()
+uint64_t byte_hashes[256];
+// Temporary file the output is written to before it is renamed into place, empty if none
+char pending_output[BUFFER];
 
 
-// Synchronization variables for multithreading ----------------------------------------------------
-
-// Controls max number of threads creatable at once
-sem_t *thread_sema;
-// Lock for condition variable
-pthread_mutex_t *cipher_lock;
-// Condition variable which signals when main thread can terminate
-pthread_cond_t *condvar;
-// Lock for generating permutation matrices
-pthread_mutex_t *permut_lock;
-// -------------------------------------------------------------------------------------------------
-
-// Globals for multithreaded generation of permutation matrices ------------------------------------
-
-// For fixed dimension: contains dimensions of all permutation matrices to be created
-// For variable dimension: bitmap of which dimensions need to be generated
-int *dim_array;
-// Size of array storing matrices to be generated
-_Atomic int dim_array_size;
-// Number of matrices to be generated
-int num_array;
-// Index counter keeps track of which matrices have been assigned to threads
-int dim_index;
-// Counter keeps track of how many matrices are finished
-_Atomic int dim_finished;
-
-// -------------------------------------------------------------------------------------------------
-
-// Globals for multithreaded linear transformations ------------------------------------------------
+// State kept by each worker of a linear transformation loop
+typedef struct transform_worker {
+  // Scratch copy of the chunk being transformed
+  unsigned char *scratch;
+  // Variable dimension sequence read by this worker
+  dim_stream stream;
+  // Chunk following the last one this worker processed, and its offset in the file
+  long next_chunk;
+  long next_offset;
+} transform_worker;
 
-// Number of threads created
-int scheduled_chunks;
-// Number of threads finished
-_Atomic int finished_chunks;
-
-// Information for performing fixed sized linear transformations on a chunk of a file
-typedef struct fixed_transform_thread {
+// Information for performing linear transformations on the chunks of a file with a work stealing loop
+typedef struct transform_loop {
   cipher *ciph;
-  // Starting point in file
-  long offset;
-  // Number of bytes to process
-  long length;
-  // Permutation matrix dimension
+  pass *p;
+  // Fixed permutation matrix dimension, 0 if variable
   int dimension;
-  // Indicates matrix inverse
-  int coeff;
-} fixed_transform_thread;
+  // Variable dimension chunk layout, NULL if fixed
+  chunk_layout *layout;
+  // Number of chunks, excluding the last chunk of arbitrary size
+  long num_chunks;
+  // Item the loop starts at, loop items are counted from it
+  long first_item;
+  transform_worker *workers;
+  steal_loop *steal;
+} transform_loop;
 
-// Information for performing variable sized linear tranformations on a chunk of a file
-typedef struct variable_transform_thread {
-  cipher *ciph;
-  // Starting point in file
+// Buffer holding one window of whole chunks of a streamed file
+typedef struct stream_window {
+  unsigned char *bytes;
+  long first_item;
+  long end_item;
+  // Offset and byte length of the window in the file
   long offset;
-  // Number of bytes to process
   long length;
-  // String of values for generating dimensions
-  char *dimension_vals;
-  // Index of first dimension value in dimension_vals
-  int map_itr_start;
-  // Indicates matrix inverse
-  int coeff;
-  // Indicates if last thread should run to eof
-  boolean last;
-} variable_transform_thread;
+  // Whether the window is being written back, otherwise it is being read
+  boolean writing;
+} stream_window;
+
+// Information for summing the chunk lengths of a range of chunk layout blocks
+typedef struct layout_thread {
+  int key_val;
+  chunk_layout *layout;
+  // Byte length of every block
+  long *block_lengths;
+  long block_start;
+  long block_end;
+  // First chunk of the range using each permut_map index, LONG_MAX if none
+  long first_use[PERMUT_MAP_SIZE];
+} layout_thread;
 // -------------------------------------------------------------------------------------------------
 
 // Constructors and Destructors
@@ -109,20 +110,31 @@ cipher *create_cipher(char *file_name, char *file_path, long file_len, char *out
   c->bytes_processed = 0;
   c->instructions = NULL;
   c->num_instructions = 0;
-  c->integrity_check = true;
-  // 9 variations of perumation matrices, mapped to base 10 digits 1-9
-  c->permut_map = (struct PMAT **)calloc(11, sizeof(struct PMAT *));
-  if(!c->permut_map) {
+  c->new_instructions = NULL;
+  c->num_new_instructions = 0;
+  c->file_bytes = NULL;
+  c->window_offset = 0;
+  c->output_fd = -1;
+  c->write_fd = -1;
+  // Nothing to wait for unless the file is being loaded
+  c->loaded = file_len;
+  pthread_mutex_init(&c->load_lock, NULL);
+  pthread_cond_init(&c->load_cond, NULL);
+  init_byte_hashes();
+  init_kernels();
+  // Worker threads live as long as the cipher and are reused by every instruction
+  c->pool = create_thread_pool(num_threads);
+  c->scratch = (unsigned char **)malloc(sizeof(unsigned char *) * c->pool->num_threads);
+  if(!c->scratch) {
     fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_cipher(), cpme.c"); exit(-1);
   }
-  thread_sema = (sem_t *)malloc(sizeof(sem_t));
-  sem_init(thread_sema, 0, num_threads);
-  cipher_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-  pthread_mutex_init(cipher_lock, NULL);
-  condvar = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-  pthread_cond_init(condvar, NULL);
-  permut_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-  pthread_mutex_init(permut_lock, NULL);
+  for(int i = 0; i < c->pool->num_threads; i++) {
+    // Kernels may read past the chunk
+    c->scratch[i] = (unsigned char *)calloc(MAX_DIMENSION + KERNEL_PADDING, sizeof(unsigned char));
+    if(!c->scratch[i]) {
+      fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_cipher(), cpme.c"); exit(-1);
+    }
+  }
   // DEBUG OUTPUT
   //debug = fopen("FB_WO_debug.txt", "a");
   return c;
@@ -135,17 +147,15 @@ int close_cipher(cipher *c) {
   //todo segfault when free file_name
   //free(c->file_path);
   //free(c->instructions);
+  for(int i = 0; i < c->pool->num_threads; i++) {
+    free(c->scratch[i]);
+  }
+  free(c->scratch);
+  close_thread_pool(c->pool);
+  pthread_mutex_destroy(&c->load_lock);
+  pthread_cond_destroy(&c->load_cond);
   free(c->file_bytes);
-  free(c->permut_map);
   free(c);
-  sem_destroy(thread_sema);
-  free(thread_sema);
-  pthread_mutex_destroy(cipher_lock);
-  free(cipher_lock);
-  pthread_cond_destroy(condvar);
-  free(condvar);
-  pthread_mutex_destroy(permut_lock);
-  free(permut_lock);
   return 1;
 }
 
@@ -160,313 +170,1092 @@ int run(cipher *c, boolean encrypt) {
     time_total_write = 0;
     time_transformation = 0;
     time_p_loop = 0;
-    unsigned char *file_bytes = read_input(c);
-    c->file_bytes = file_bytes;
-    read_instructions(c, coeff);
-    write_output(c, coeff);
+    bytes_skipped = 0;
+    if(in_place) {
+      map_instructions(c, coeff);
+    } else if(memory_budget > 0) {
+      stream_instructions(c, coeff);
+    } else {
+      FILE *in = open_input(c);
+      c->file_bytes = (unsigned char *)malloc(sizeof(unsigned char) * ((size_t)c->file_len + 1));
+      if(!c->file_bytes) {
+        fatal(LOG_OUTPUT, "Dynamic memory allocation error in run(), cpme.c."); exit(EXIT_FAILURE);
+      }
+      // Workers write the output as they finish the last instruction
+      c->output_fd = open_output(c, coeff);
+      // The file is read while the first instruction transforms what has been read
+      read_instructions(c, coeff, in);
+      fclose(in);
+      commit_output(c, coeff, c->output_fd);
+      c->output_fd = -1;
+    }
     if(verbose_lvl_2) {
       printf("Time generating permutation matrices (ms): %.2lf\n", (double)time_total_gen*1000/CLOCKS_PER_SEC);
       printf("Time writing matrices to file (ms): %.2lf\n", (double)time_total_write*1000/CLOCKS_PER_SEC);
       printf("Time performing linear transformation (ms): %.2lf\n", (double)time_transformation*1000/CLOCKS_PER_SEC);
-      printf("Time in node pull loop (ms): %.2lf\n", (double)time_p_loop*1000/CLOCKS_PER_SEC);
+      printf("Time in index pull loop (ms): %.2lf\n", (double)time_p_loop*1000/CLOCKS_PER_SEC);
+      printf("Uniform bytes skipped: %ld\n", bytes_skipped);
     }
     return 1;
 }
 
 /*
- * Processes a section of a file using variable dimension permutation matrices.
+ * Allocates the per worker state of a linear transformation loop over the chunks of the cipher's file
+ * for the given pass.
  */
-void *variable_thread_func(void *args) {
-  //create encrypt map of length required for file instead of looping
-  //todo limits file size to max size of unsigned int in bytes, ~4GB
-  if(!args) {
-    fatal(LOG_OUTPUT, "Null args reference in fixed_thread_func(), cpme.c."); exit(EXIT_FAILURE);
-  }
-  variable_transform_thread *vtt = (variable_transform_thread *)args;
-  long bytes_remaining = vtt->length;
-  long working_offset = vtt->offset;
-  int limit = vtt->last ? MAX_DIMENSION : 0;
-  if(bytes_remaining > limit) {
-    int map_len = (int)strlen(vtt->dimension_vals);
-    for(int map_itr = vtt->map_itr_start; bytes_remaining > limit; map_itr++) {
-      int map_index = (charAt(vtt->dimension_vals, map_itr % map_len) - '0');
-      map_index = map_index > 1 ? map_index : 1;
-      int dimension = map_index > 1 ? MAX_DIMENSION - (MAX_DIMENSION / map_index) : MAX_DIMENSION;
-      permut_cipher(vtt->ciph, map_index, working_offset);
-      bytes_remaining -= dimension;
-      working_offset += dimension;
+transform_loop *init_transform_loop(cipher *c, pass *p) {
+  transform_loop *loop = (transform_loop *)malloc(sizeof(transform_loop));
+  int num_workers = c->pool->num_threads;
+  transform_worker *workers = (transform_worker *)malloc(sizeof(transform_worker) * num_workers);
+  if(!loop || !workers) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_transform_loop(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  chunk_layout *layout = p->layout;
+  loop->ciph = c;
+  loop->p = p;
+  loop->dimension = p->dimension;
+  loop->layout = layout;
+  loop->num_chunks = layout ? layout->num_chunks : c->file_len / p->dimension;
+  loop->first_item = 0;
+  loop->workers = workers;
+  loop->steal = NULL;
+  for(int i = 0; i < num_workers; i++) {
+    // Owned by the cipher, so streaming windows do not allocate
+    workers[i].scratch = c->scratch[i];
+    if(layout) {
+      init_dim_stream(&workers[i].stream, p->key_val, layout->sequence_length);
     }
+    workers[i].next_chunk = -1;
+    workers[i].next_offset = 0;
+  }
+  return loop;
+}
+
+/*
+ * Frees given linear transformation loop.
+ */
+void free_transform_loop(transform_loop *loop) {
+  free(loop->workers);
+  free(loop);
+}
+
+/*
+ * Returns the number of chunks a worker takes at a time from a loop over the given number of chunks.
+ * Uses grain_size if set, otherwise aims for 16 grains per thread.
+ */
+long transform_grain(long num_items) {
+  if(grain_size > 0) {
+    return grain_size;
+  }
+  long grain = num_items / ((long)num_threads * 16);
+  return grain > 0 ? grain : 1;
+}
+
+/*
+ * Processes a range of chunks of a file using variable dimension permutation matrices. The last chunk
+ * of arbitrary size is item num_chunks.
+ */
+void variable_range_func(void *args, long start, long end, int worker) {
+  transform_loop *loop = (transform_loop *)args;
+  transform_worker *w = &loop->workers[worker];
+  pass *p = loop->p;
+  start += loop->first_item;
+  end += loop->first_item;
+  // Continue from this worker's last range if contiguous, otherwise locate the first chunk
+  long working_offset = w->next_chunk == start ? w->next_offset
+                                               : chunk_offset(loop->layout, &w->stream, start);
+  long range_offset = working_offset;
+  long loaded = 0;
+  long chunk_end = end < loop->num_chunks ? end : loop->num_chunks;
+  for(long chunk = start; chunk < chunk_end; chunk++) {
+    int map_index = map_index_at(&w->stream, chunk);
+    int dimension = variable_dimension(map_index);
+    if(working_offset + dimension > loaded) {
+      loaded = wait_loaded(loop->ciph, working_offset + dimension);
+    }
+    permut_cipher(loop->ciph, pass_mat(p, map_index), p->integrity_check, working_offset, w->scratch);
+    working_offset += dimension;
+  }
+  if(end > loop->num_chunks) {
+    wait_loaded(loop->ciph, loop->ciph->file_len);
+    // Last permutation matrix of arbitrary size stored in 11th array slot, index 10
+    permut_cipher(loop->ciph, pass_mat(p, 10), p->integrity_check, working_offset, w->scratch);
+  }
+  if(loop->ciph->write_fd >= 0) {
+    long range_end = end > loop->num_chunks ? loop->ciph->file_len : working_offset;
+    write_chunks(loop->ciph, range_offset, range_end - range_offset);
+  }
+  w->next_chunk = end;
+  w->next_offset = working_offset;
+}
+
+/*
+ * Processes a range of chunks of a file using fixed dimension permutation matrix. The last chunk of
+ * arbitrary size is item num_chunks.
+ */
+void fixed_range_func(void *args, long start, long end, int worker) {
+  transform_loop *loop = (transform_loop *)args;
+  transform_worker *w = &loop->workers[worker];
+  pass *p = loop->p;
+  start += loop->first_item;
+  end += loop->first_item;
+  long loaded = 0;
+  long chunk_end = end < loop->num_chunks ? end : loop->num_chunks;
+  for(long chunk = start; chunk < chunk_end; chunk++) {
+    long offset = chunk * loop->dimension;
+    if(offset + loop->dimension > loaded) {
+      loaded = wait_loaded(loop->ciph, offset + loop->dimension);
+    }
+    // Permutation matrix of size dimension stored in permut_map index 1
+    permut_cipher(loop->ciph, pass_mat(p, 1), p->integrity_check, offset, w->scratch);
+  }
+  if(end > loop->num_chunks) {
+    wait_loaded(loop->ciph, loop->ciph->file_len);
+    // Permutation matrix of size of remaining bytes stored in permut_map index 2
+    permut_cipher(loop->ciph, pass_mat(p, 2), p->integrity_check, loop->num_chunks * loop->dimension, w->scratch);
+  }
+  if(loop->ciph->write_fd >= 0) {
+    long range_end = end > loop->num_chunks ? loop->ciph->file_len : end * loop->dimension;
+    write_chunks(loop->ciph, start * loop->dimension, range_end - start * loop->dimension);
+  }
+}
+
+/*
+ * Facilitates matrix transformations. Takes the permutation matrix, the offset of the chunk in the
+ * file and a scratch buffer of at least MAX_DIMENSION + KERNEL_PADDING bytes owned by the calling thread. The chunk
+ * must lie in the window of the file held in file_bytes. Gathering from the scratch copy beats
+ * following the permutation's cycles in place, whose loads each wait on the previous one.
+ */
+void permut_cipher(cipher *c, struct PMAT *permutation_mat, integrity_mode integrity_check, long ref,
+                   unsigned char *scratch) {
+  unsigned char *data = c->file_bytes + (ref - c->window_offset);
+  if(!permutation_mat) {
+    fatal(LOG_OUTPUT, "Null reference to permutation matrix in permut_cipher(), cpme.c.");
+    exit(EXIT_FAILURE);
+  }
+  int dimension = permutation_mat->dimension;
+  if(uniform_bytes(dimension, data)) {
+    __atomic_add_fetch(&bytes_skipped, dimension, __ATOMIC_RELAXED);
+  } else {
+    memcpy(scratch, data, (size_t)sizeof(unsigned char)*dimension);
+    //transform from the scratch copy straight back into the file
+    boolean preserved = transform_vec(dimension, data, scratch, permutation_mat, integrity_check);
+    //check for data preservation error
+    if(!preserved) {
+      char message[BUFFER];
+      snprintf(message, BUFFER, "%s\n%ld%s\n%s\n", "Corruption detected in encryption.", c->bytes_remaining,
+               " unencrypted bytes remaining.", "Aborting.");
+      fatal(c->log_path, message);
+    }
+  }
+  c->bytes_processed += dimension;
+  c->bytes_remaining -= dimension;
+}
+
+/*
+ * Marks the first loaded bytes of file_bytes as read and wakes the workers waiting for them.
+ */
+void publish_loaded(cipher *c, long loaded) {
+  pthread_mutex_lock(&c->load_lock);
+  c->loaded = loaded;
+  pthread_cond_broadcast(&c->load_cond);
+  pthread_mutex_unlock(&c->load_lock);
+}
+
+/*
+ * Blocks until at least the first needed bytes of file_bytes are loaded. Returns the number loaded.
+ */
+long wait_loaded(cipher *c, long needed) {
+  long loaded = c->loaded;
+  if(loaded >= needed) {
+    return loaded;
+  }
+  pthread_mutex_lock(&c->load_lock);
+  while(c->loaded < needed) {
+    pthread_cond_wait(&c->load_cond, &c->load_lock);
+  }
+  loaded = c->loaded;
+  pthread_mutex_unlock(&c->load_lock);
+  return loaded;
+}
+
+// Passes ------------------------------------------------------------------------------------------
+
+/*
+ * Returns the instruction executed by the given pass, counted from 0. Encryption executes the
+ * instructions forwards, decryption backwards.
+ */
+instruction *instruction_at(cipher *c, int coeff, int pass_index) {
+  int index = coeff > 0 ? pass_index : c->num_instructions - 1 - pass_index;
+  return c->instructions[index];
+}
+
+/*
+ * Prepares the given pass to execute the given instruction. Loads its key and lays out its chunks.
+ * Matrices are not generated yet.
+ */
+void init_pass(cipher *c, pass *p, instruction *cur, int coeff) {
+  //FIXED: dimension cannot be larger than max dimension
+  int dimension = cur->dimension > MAX_DIMENSION ? MAX_DIMENSION : cur->dimension;
+  p->ins = cur;
+  p->key_val = key_sum(cur->encrypt_key);
+  p->integrity_check = cur->integrity_check;
+  p->inverse = coeff < 0;
+  p->permut_map = (struct PMAT **)calloc(PERMUT_MAP_SIZE, sizeof(struct PMAT *));
+  if(!p->permut_map) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_pass(), cpme.c"); exit(-1);
+  }
+  p->mats = create_task_group();
+  p->mat_bytes = 0;
+  pthread_mutex_init(&p->mats_lock, NULL);
+  pthread_cond_init(&p->mat_ready, NULL);
+  if(dimension > 0) { //fixed dimension
+    p->dimension = dimension;
+    p->layout = NULL;
+    p->num_items = c->file_len / dimension + (c->file_len % dimension > 0 ? 1 : 0);
+  } else { //flexible dimension
+    p->dimension = 0;
+    // Lay out chunks so the last matrix is known up front
+    p->layout = build_chunk_layout(c, p->key_val);
+    p->num_items = p->layout->num_chunks + (p->layout->tail > 0 ? 1 : 0);
   }
-  int dimension = (int) bytes_remaining;
-  if(dimension > 0) {
-    // Generate final permutation matrix of arbitrary size
-    // Create last permutation matrix of arbitrary size on-demand
-    permut_thread *pt = (permut_thread *)malloc(sizeof(permut_thread));
-    pt->index = dim_index;
-    pt->dimension = dimension;
-    pt->c = vtt->ciph;
-    pt->inverse = vtt->coeff < 0;
-    pt->post = false;
-    pthread_t thread;
-    pthread_create(&thread, NULL, permut_thread_func, (void *) pt);
-    pthread_join(thread, NULL);
-    dim_array_size += 1;
-    // Last matrix stored 11th array slot, index 10
-    permut_cipher(vtt->ciph, 10, working_offset);
-  }
-  free(vtt);
-  finished_chunks += 1;
-  sem_post(thread_sema);
-  pthread_cond_broadcast(condvar);
-  pthread_detach(pthread_self());
-  return NULL;
 }
 
 /*
- * Splits file into MAX_THREADS chunks each of which to be processed by a thread using variable
- * dimension transformations.
+ * Prepares a pass for every instruction, in execution order, and starts generating the matrices of
+ * as many of them as fit MATRIX_BUDGET on the pool. Matrices depend only on the key, dimension and
+ * file length, so they are generated while the file is read and while earlier passes transform.
+ * When rekeying, the new instructions follow as encryption passes.
  */
-void variable_thread_scheduler(cipher *c, int coeff) {
-  finished_chunks = 0;
-  scheduled_chunks = 0;
-  int map_index = 0;
-  long working_offset = 0;
-  long bytes_remaining = c->file_len;
-  long calculations_per_chunk = c->file_len / (MAX_DIMENSION) / num_threads;
-  long approx = c->file_len / MAX_DIMENSION;
-  char *linked = gen_linked_vals(c, (unsigned int)approx);
-  int map_len = (int)strlen(linked);
+pass_plan *plan_passes(cipher *c, int coeff) {
+  if(c->num_instructions == 0) {
+    fatal(LOG_OUTPUT, "No instructions found.");
+  }
+  pass_plan *plan = (pass_plan *)malloc(sizeof(pass_plan));
+  int num_passes = c->num_instructions + c->num_new_instructions;
+  pass *passes = (pass *)malloc(sizeof(pass) * num_passes);
+  if(!plan || !passes) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in plan_passes(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  plan->passes = passes;
+  plan->num_passes = num_passes;
+  plan->num_submitted = 0;
+  plan->resident = 0;
+  // Every layout first, generation tasks queued ahead of them would delay them
+  for(int i = 0; i < c->num_instructions; i++) {
+    init_pass(c, &passes[i], instruction_at(c, coeff, i), coeff);
+  }
+  for(int i = 0; i < c->num_new_instructions; i++) {
+    init_pass(c, &passes[c->num_instructions + i], c->new_instructions[i], 1);
+  }
+  submit_planned(c, plan);
+  return plan;
+}
+
+/*
+ * Queues the matrices of the following passes while they fit MATRIX_BUDGET. The first pass not yet
+ * retired is always queued, so the pass being executed never waits on a matrix which is not queued.
+ */
+void submit_planned(cipher *c, pass_plan *plan) {
+  while(plan->num_submitted < plan->num_passes) {
+    pass *p = &plan->passes[plan->num_submitted];
+    if(plan->resident > 0 && plan->resident + pass_mat_bytes(c, p) > MATRIX_BUDGET) {
+      return;
+    }
+    submit_next_pass(c, plan);
+  }
+}
+
+/*
+ * Queues the matrices of the first pass not yet queued, regardless of MATRIX_BUDGET.
+ */
+void submit_next_pass(cipher *c, pass_plan *plan) {
+  pass *p = &plan->passes[plan->num_submitted];
+  long bytes = pass_mat_bytes(c, p);
+  if(p->layout) {
+    submit_variable_permut_mats(c, p);
+  } else {
+    submit_fixed_permut_mats(c, p);
+  }
+  p->mat_bytes = bytes;
+  plan->resident += bytes;
+  plan->num_submitted += 1;
+}
+
+/*
+ * Ends the given pass once it has been executed, then queues the matrices of the passes which now
+ * fit the budget. Passes must be retired in order.
+ */
+void retire_pass(cipher *c, pass_plan *plan, int index) {
+  pass *p = &plan->passes[index];
+  end_pass(p);
+  plan->resident -= p->mat_bytes;
+  submit_planned(c, plan);
+}
+
+/*
+ * Frees given plan. Every pass must have been retired.
+ */
+void free_plan(pass_plan *plan) {
+  free(plan->passes);
+  free(plan);
+}
+
+/*
+ * Starts the pass's linear transformations on the chunks from item first to item end - 1 on the
+ * pool. Workers wait for each matrix they need and for the chunks to be loaded. The chunks must lie in
+ * the window of the file held in file_bytes.
+ */
+transform_loop *start_transform(cipher *c, pass *p, long first, long end) {
   if(verbose_lvl_2) {
     printf("Performing linear transformations...\n");
   }
-  if(calculations_per_chunk > 0) {
-    for(int i = 0; i < (num_threads - 1); i++) {
-      if(bytes_remaining < MAX_DIMENSION) {
-        break;
-      }
-      int length = 0;
-      int map_itr_start = map_index % map_len;
-      for(int j = 0; j < calculations_per_chunk; j++, map_index++) {
-        int tmp = (charAt(linked, map_index % map_len) - '0');
-        int dimension = tmp > 1 ? MAX_DIMENSION - (MAX_DIMENSION / tmp) : MAX_DIMENSION;
-        if((bytes_remaining - dimension) < 0) {
-          break;
+  c->bytes_remaining = c->file_len;
+  c->bytes_processed = 0;
+  transform_loop *loop = init_transform_loop(c, p);
+  loop->first_item = first;
+  long num_items = end - first;
+  range_func func = p->layout ? variable_range_func : fixed_range_func;
+  loop->steal = start_steal_loop(c->pool, num_items, transform_grain(num_items), func, (void *)loop);
+  return loop;
+}
+
+/*
+ * Waits for the given linear transformations to finish and frees them.
+ */
+void finish_transform(transform_loop *loop) {
+  finish_steal_loop(loop->steal);
+  free_transform_loop(loop);
+}
+
+/*
+ * Performs the pass's linear transformations on the chunks from item first to item end - 1. The
+ * chunks must lie in the window of the file held in file_bytes.
+ */
+void transform_pass(cipher *c, pass *p, long first, long end) {
+  if(first >= end) {
+    return;
+  }
+  finish_transform(start_transform(c, p, first, end));
+}
+
+/*
+ * Returns the byte length of the given item of the pass. Stream must have been initialized for the
+ * pass's key when variable.
+ */
+long item_length(cipher *c, pass *p, dim_stream *stream, long item) {
+  if(p->layout) {
+    return item < p->layout->num_chunks ? variable_dimension(map_index_at(stream, item)) : p->layout->tail;
+  }
+  long num_chunks = c->file_len / p->dimension;
+  return item < num_chunks ? p->dimension : c->file_len % p->dimension;
+}
+
+/*
+ * Waits for the pass's matrices, then frees them and its chunk layout and wipes its key.
+ */
+void end_pass(pass *p) {
+  wait_task_group(p->mats);
+  free_task_group(p->mats);
+  if(p->layout) {
+    free_chunk_layout(p->layout);
+    p->layout = NULL;
+  }
+  purge_maps(p->permut_map);
+  free(p->permut_map);
+  pthread_mutex_destroy(&p->mats_lock);
+  pthread_cond_destroy(&p->mat_ready);
+  p->key_val = 0;
+}
+
+/*
+ * Stores a finished matrix in the pass's given permut_map slot and wakes the workers waiting for it.
+ * Every slot is published at most once.
+ */
+void publish_mat(pass *p, int index, struct PMAT *m) {
+  pthread_mutex_lock(&p->mats_lock);
+  __atomic_store_n(&p->permut_map[index], m, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&p->mat_ready);
+  pthread_mutex_unlock(&p->mats_lock);
+}
+
+/*
+ * Returns the pass's matrix in the given permut_map slot, blocking until it has been published.
+ */
+struct PMAT *pass_mat(pass *p, int index) {
+  struct PMAT *m = __atomic_load_n(&p->permut_map[index], __ATOMIC_ACQUIRE);
+  if(m) {
+    return m;
+  }
+  pthread_mutex_lock(&p->mats_lock);
+  while(!(m = __atomic_load_n(&p->permut_map[index], __ATOMIC_ACQUIRE))) {
+    pthread_cond_wait(&p->mat_ready, &p->mats_lock);
+  }
+  pthread_mutex_unlock(&p->mats_lock);
+  return m;
+}
+
+/*
+ * Executes every instruction while holding at most memory_budget bytes of the file in memory. Every
+ * pass reads the file in windows of whole chunks, transforms them and writes them to the output file
+ * in place. The first pass reads the input file, later passes the output of the pass before. Up to
+ * IO_DEPTH windows are in flight at a time, so windows are read and written while others are being
+ * transformed. A pass's writes all finish before the next pass reads.
+ */
+void stream_instructions(cipher *c, int coeff) {
+  // Matrices are generated while the first windows are read
+  pass_plan *plan = plan_passes(c, coeff);
+  char *in_path = input_path(c);
+  int in = open(in_path, O_RDONLY);
+  if(in < 0) {
+    fatal(LOG_OUTPUT, "Error opening file in stream_instructions(), cpme.c.");
+  }
+  // Budget is split between the windows in flight, each must hold the largest chunk
+  long window_budget = memory_budget / IO_DEPTH;
+  window_budget = window_budget > MAX_DIMENSION ? window_budget : MAX_DIMENSION;
+  window_budget = window_budget < c->file_len ? window_budget : c->file_len;
+  stream_window windows[IO_DEPTH];
+  stream_window *idle[IO_DEPTH];
+  for(int i = 0; i < IO_DEPTH; i++) {
+    windows[i].bytes = (unsigned char *)malloc(sizeof(unsigned char) * (size_t)(window_budget + 1));
+    if(!windows[i].bytes) {
+      fatal(LOG_OUTPUT, "Dynamic memory allocation error in stream_instructions(), cpme.c."); exit(EXIT_FAILURE);
+    }
+    idle[i] = &windows[i];
+  }
+  // Passes after the first read back what the pass before wrote
+  int out = open_output(c, coeff);
+  io_queue *queue = create_io_queue(IO_DEPTH);
+  for(int pass_index = 0; pass_index < plan->num_passes; pass_index++) {
+    pass *p = &plan->passes[pass_index];
+    printf("Executing instruction %d...\n", pass_index + 1);
+    dim_stream stream;
+    if(p->layout) {
+      init_dim_stream(&stream, p->key_val, p->layout->sequence_length);
+    }
+    int src = pass_index == 0 ? in : out;
+    int num_idle = IO_DEPTH;
+    long item = 0;
+    long offset = 0;
+    while(item < p->num_items || num_idle < IO_DEPTH) {
+      // Start reading the following windows into every idle buffer
+      while(num_idle > 0 && item < p->num_items) {
+        stream_window *w = idle[--num_idle];
+        w->first_item = item;
+        w->offset = offset;
+        w->length = 0;
+        // Extend the window by whole chunks while they fit the budget
+        while(item < p->num_items) {
+          long len = item_length(c, p, &stream, item);
+          if(w->length + len > window_budget) {
+            break;
+          }
+          w->length += len;
+          item++;
         }
-        length += dimension;
-        bytes_remaining -= dimension;
+        w->end_item = item;
+        w->writing = false;
+        offset += w->length;
+        submit_io(queue, src, w->bytes, w->offset, w->length, false, (void *)w);
       }
-      // Acquire available thread
-      sem_wait(thread_sema);
-      pthread_t thread;
-      variable_transform_thread *vtt = (variable_transform_thread *)malloc(sizeof(variable_transform_thread));
-      if(!vtt) {
-        fatal(LOG_OUTPUT, "Dynamic memory allocation error in fixed_thread_scheduler(), cpme.c.");
-        exit(EXIT_FAILURE);
+      stream_window *w = (stream_window *)reap_io(queue);
+      if(w->writing) {
+        idle[num_idle++] = w;
+        continue;
       }
-      vtt->map_itr_start = map_itr_start;
-      vtt->length = length;
-      vtt->offset = working_offset;
-      vtt->dimension_vals = linked;
-      vtt->coeff = coeff;
-      vtt->ciph = c;
-      vtt->last = false;
-      working_offset += length;
-      scheduled_chunks += 1;
-      pthread_create(&thread, NULL, variable_thread_func, (void *)vtt);
+      // Loaded, transform and write back
+      c->file_bytes = w->bytes;
+      c->window_offset = w->offset;
+      transform_pass(c, p, w->first_item, w->end_item);
+      w->writing = true;
+      submit_io(queue, out, w->bytes, w->offset, w->length, true, (void *)w);
     }
+    retire_pass(c, plan, pass_index);
   }
+  free_plan(plan);
+  print_io_stats(queue);
+  close_io_queue(queue);
+  for(int i = 0; i < IO_DEPTH; i++) {
+    free(windows[i].bytes);
+  }
+  c->file_bytes = NULL;
+  c->window_offset = 0;
+  close(in);
+  commit_output(c, coeff, out);
+  free(in_path);
+}
 
-  // Acquire available thread
-  sem_wait(thread_sema);
-  pthread_t thread;
-  variable_transform_thread *vtt = (variable_transform_thread *)malloc(sizeof(variable_transform_thread));
-  if(!vtt) {
-    fatal(LOG_OUTPUT, "Dynamic memory allocation error in fixed_thread_scheduler(), cpme.c.");
-    exit(EXIT_FAILURE);
+/*
+ * Executes every instruction directly on a shared memory mapping of the input file, then renames it
+ * to the output name. No copy of the file is made in memory or on disk.
+ */
+void map_instructions(cipher *c, int coeff) {
+  char *in_path = input_path(c);
+  char *out_path = output_path(c, coeff);
+  int fd = open(in_path, O_RDWR);
+  if(fd < 0) {
+    fatal(LOG_OUTPUT, "Error opening file in map_instructions(), cpme.c.");
   }
-  vtt->map_itr_start = map_index % map_len;
-  vtt->offset = working_offset;
-  vtt->length = c->file_len - working_offset;
-  vtt->dimension_vals = linked;
-  vtt->coeff = coeff;
-  vtt->ciph = c;
-  vtt->last = true;
-  scheduled_chunks += 1;
-  pthread_create(&thread, NULL, variable_thread_func, (void *)vtt);
-  // Wait for all threads to finish
-  pthread_mutex_lock(cipher_lock);
-  while(finished_chunks < scheduled_chunks) {
-    pthread_cond_wait(condvar, cipher_lock);
+  size_t map_len = (size_t)c->file_len;
+  unsigned char *map = NULL;
+  if(map_len > 0) {
+    map = (unsigned char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+      fatal(LOG_OUTPUT, "Error mapping file in map_instructions(), cpme.c.");
+    }
+    // Workers walk their chunk ranges forwards, start reading the whole file ahead of them
+    posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(map, map_len, POSIX_MADV_WILLNEED);
   }
-  free(linked);
-  pthread_mutex_unlock(cipher_lock);
+  c->file_bytes = map;
+  read_instructions(c, coeff, NULL);
+  c->file_bytes = NULL;
+  if(map_len > 0) {
+    if(msync(map, map_len, MS_SYNC) != 0) {
+      fatal(LOG_OUTPUT, "Error writing mapped file in map_instructions(), cpme.c.");
+    }
+    munmap(map, map_len);
+  }
+  close(fd);
+  if(strcmp(in_path, out_path) != 0 && rename(in_path, out_path) != 0) {
+    fatal(LOG_OUTPUT, "Error renaming file in map_instructions(), cpme.c.");
+  }
+  free(in_path);
+  free(out_path);
 }
 
+// Composition -------------------------------------------------------------------------------------
+
 /*
- * Processes a section of a file using fixed dimension permutation matrix.
+ * Returns the bytes held by a composition over super-blocks of the given length, its gather table
+ * and the scratch copy of every worker.
  */
-void *fixed_thread_func(void *args) {
-  if(!args) {
-    fatal(LOG_OUTPUT, "Null args reference in fixed_thread_func(), cpme.c."); exit(EXIT_FAILURE);
+long composed_bytes(cipher *c, long block_len) {
+  return block_len * ((long)sizeof(uint32_t) + c->pool->num_threads);
+}
+
+/*
+ * Returns the end of the run of passes composed with the given first pass. Consecutive fixed
+ * dimension passes are composed while the least common multiple of their dimensions stays within
+ * COMPOSE_BLOCK_MAX, the composition fits MATRIX_BUDGET and the file holds at least one super-block
+ * per thread. Returns first + 1 if the pass is executed on its own.
+ */
+int compose_end(cipher *c, pass_plan *plan, int first) {
+  long block_len = 1;
+  int end = first;
+  while(end < plan->num_passes && !plan->passes[end].layout) {
+    long dimension = plan->passes[end].dimension;
+    long next_len = block_len / greatest_common_divisor(block_len, dimension) * dimension;
+    if(next_len > COMPOSE_BLOCK_MAX || composed_bytes(c, next_len) > MATRIX_BUDGET
+       || c->file_len / next_len < c->pool->num_threads) {
+      break;
+    }
+    block_len = next_len;
+    end++;
   }
-  fixed_transform_thread *ftt = (fixed_transform_thread *)args;
-  long bytes_remaining = ftt->length;
-  long working_offset = ftt->offset;
-  while(bytes_remaining >= ftt->dimension) {
-    // Permutation matrix of size dimension stored in permut_map index 1
-    permut_cipher(ftt->ciph, 1, working_offset);
-    bytes_remaining -= ftt->dimension;
-    working_offset += ftt->dimension;
-  }
-  if(bytes_remaining > 0) {
-    // Permutation matrix of size bytes_remaining stored in permut_map index 2
-    permut_cipher(ftt->ciph, 2, working_offset);
-  }
-  free(ftt);
-  finished_chunks += 1;
-  sem_post(thread_sema);
-  pthread_cond_broadcast(condvar);
-  pthread_detach(pthread_self());
+  return end - first > 1 ? end : first + 1;
+}
+
+/*
+ * Prepares the composition of the given passes of the plan and starts building its gather table on
+ * the pool once their matrices are generated. The composition counts against MATRIX_BUDGET until
+ * it is freed. Matrices of every composed pass are queued, even past MATRIX_BUDGET.
+ */
+composed_pass *init_composed_pass(cipher *c, pass_plan *plan, int first, int end) {
+  composed_pass *cp = (composed_pass *)malloc(sizeof(composed_pass));
+  int num_workers = c->pool->num_threads;
+  unsigned char **scratch = (unsigned char **)malloc(sizeof(unsigned char *) * num_workers);
+  if(!cp || !scratch) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_composed_pass(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  cp->ciph = c;
+  cp->plan = plan;
+  cp->first = first;
+  cp->end = end;
+  cp->block_len = 1;
+  cp->integrity_check = CHECK_NONE;
+  for(int i = first; i < end; i++) {
+    long dimension = plan->passes[i].dimension;
+    cp->block_len = cp->block_len / greatest_common_divisor(cp->block_len, dimension) * dimension;
+    if(plan->passes[i].integrity_check > cp->integrity_check) {
+      cp->integrity_check = plan->passes[i].integrity_check;
+    }
+  }
+  cp->num_blocks = c->file_len / cp->block_len;
+  cp->gather = NULL;
+  cp->scratch = scratch;
+  for(int i = 0; i < num_workers; i++) {
+    scratch[i] = (unsigned char *)malloc(sizeof(unsigned char) * cp->block_len);
+    if(!scratch[i]) {
+      fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_composed_pass(), cpme.c."); exit(EXIT_FAILURE);
+    }
+  }
+  plan->resident += composed_bytes(c, cp->block_len);
+  while(plan->num_submitted < end) {
+    submit_next_pass(c, plan);
+  }
+  // Queued after the matrices it waits for and before the transforms waiting for it
+  cp->built = create_task_group();
+  submit_task(c->pool, cp->built, gather_thread_func, (void *)cp);
+  return cp;
+}
+
+/*
+ * Builds the gather table of a composition by moving the offsets of a super-block through the
+ * matrices of every composed pass, in order.
+ */
+void *gather_thread_func(void *args) {
+  composed_pass *cp = (composed_pass *)args;
+  long block_len = cp->block_len;
+  uint32_t *source = (uint32_t *)malloc(sizeof(uint32_t) * block_len);
+  uint32_t *moved = (uint32_t *)malloc(sizeof(uint32_t) * block_len);
+  if(!source || !moved) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in gather_thread_func(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  for(long i = 0; i < block_len; i++) {
+    source[i] = (uint32_t)i;
+  }
+  for(int pass_index = cp->first; pass_index < cp->end; pass_index++) {
+    // Every chunk of the super-block is whole, permutation matrix of size dimension in index 1
+    struct PMAT *m = pass_mat(&cp->plan->passes[pass_index], 1);
+    int dimension = m->dimension;
+    for(long offset = 0; offset < block_len; offset += dimension) {
+      for(int i = 0; i < dimension; i++) {
+        moved[offset + i] = source[offset + m->index[i]];
+      }
+    }
+    uint32_t *swap = source;
+    source = moved;
+    moved = swap;
+  }
+  free(moved);
+  cp->gather = source;
   return NULL;
 }
 
 /*
- * Splits file into MAX_THREADS chunks each of which to be processed by a thread using fixed
- * dimension tranformations.
+ * Applies the gather table of a composition to a range of super-blocks of a file.
  */
-void fixed_thread_scheduler(cipher *c, int coeff, int dimension) {
-  long chunk_size;
-  int chunk_index;
-  finished_chunks = 0;
-  scheduled_chunks = 0;
+void composed_range_func(void *args, long start, long end, int worker) {
+  composed_pass *cp = (composed_pass *)args;
+  cipher *c = cp->ciph;
+  unsigned char *scratch = cp->scratch[worker];
+  long block_len = cp->block_len;
+  wait_task_group(cp->built);
+  uint32_t *gather = cp->gather;
+  long loaded = 0;
+  for(long block = start; block < end; block++) {
+    long offset = block * block_len;
+    if(offset + block_len > loaded) {
+      loaded = wait_loaded(c, offset + block_len);
+    }
+    unsigned char *data = c->file_bytes + (offset - c->window_offset);
+    if(uniform_bytes(block_len, data)) {
+      __atomic_add_fetch(&bytes_skipped, block_len, __ATOMIC_RELAXED);
+      c->bytes_processed += block_len;
+      c->bytes_remaining -= block_len;
+      continue;
+    }
+    memcpy(scratch, data, (size_t)block_len);
+    clock_t transform_start = clock();
+    for(long i = 0; i < block_len; i++) {
+      data[i] = scratch[gather[i]];
+    }
+    __atomic_add_fetch(&time_transformation, clock() - transform_start, __ATOMIC_RELAXED);
+    boolean preserved = true;
+    if(cp->integrity_check == CHECK_DOT) {
+      preserved = check_gather_integrity(block_len, data, scratch, gather);
+    } else if(cp->integrity_check == CHECK_MULTISET) {
+      preserved = check_multiset(block_len, data, scratch);
+    }
+    if(!preserved) {
+      char message[BUFFER];
+      snprintf(message, BUFFER, "%s\n%ld%s\n%s\n", "Corruption detected in encryption.", c->bytes_remaining,
+               " unencrypted bytes remaining.", "Aborting.");
+      fatal(c->log_path, message);
+    }
+    c->bytes_processed += block_len;
+    c->bytes_remaining -= block_len;
+  }
+  if(c->write_fd >= 0) {
+    write_chunks(c, start * block_len, (end - start) * block_len);
+  }
+}
+
+/*
+ * Executes the composed passes on the file held in file_bytes. The super-blocks are transformed
+ * once with the gather table, then every pass transforms its chunks after the last super-block. If
+ * an input file is given, it is read into file_bytes while the super-blocks read are transformed.
+ * The last pass of the plan writes its chunks to the output, if open.
+ */
+void execute_composed(cipher *c, composed_pass *cp, FILE *in) {
+  int output_fd = cp->end == cp->plan->num_passes ? c->output_fd : -1;
   if(verbose_lvl_2) {
-    printf("Performing linear transformations...\n");
+    printf("Performing composed linear transformations over %ld byte super-blocks...\n", cp->block_len);
+  }
+  c->bytes_remaining = c->file_len;
+  c->bytes_processed = 0;
+  c->write_fd = output_fd;
+  steal_loop *steal = start_steal_loop(c->pool, cp->num_blocks, transform_grain(cp->num_blocks),
+                                       composed_range_func, (void *)cp);
+  if(in) {
+    read_input(c, in);
+  }
+  finish_steal_loop(steal);
+  // Every dimension divides the super-block length, so each pass's chunks start where they end
+  long composed_len = cp->num_blocks * cp->block_len;
+  for(int pass_index = cp->first; pass_index < cp->end; pass_index++) {
+    pass *p = &cp->plan->passes[pass_index];
+    c->write_fd = pass_index == cp->end - 1 ? output_fd : -1;
+    transform_pass(c, p, composed_len / p->dimension, p->num_items);
+  }
+  c->write_fd = -1;
+}
+
+/*
+ * Frees given composition once executed.
+ */
+void free_composed_pass(composed_pass *cp) {
+  wait_task_group(cp->built);
+  free_task_group(cp->built);
+  for(int i = 0; i < cp->ciph->pool->num_threads; i++) {
+    free(cp->scratch[i]);
+  }
+  free(cp->scratch);
+  free(cp->gather);
+  cp->plan->resident -= composed_bytes(cp->ciph, cp->block_len);
+  free(cp);
+}
+
+// Wavefronts --------------------------------------------------------------------------------------
+
+/*
+ * Returns the end of the wavefront starting at the given pass. Passes are added while they are not
+ * composed with the passes after them and the matrices of every pass fit MATRIX_BUDGET. Returns
+ * first + 1 if the pass is executed on its own.
+ */
+int wave_end(cipher *c, pass_plan *plan, int first) {
+  long bytes = pass_mat_bytes(c, &plan->passes[first]);
+  int end = first + 1;
+  while(end < plan->num_passes && compose_end(c, plan, end) == end + 1) {
+    bytes += pass_mat_bytes(c, &plan->passes[end]);
+    if(bytes > MATRIX_BUDGET) {
+      break;
+    }
+    end++;
+  }
+  return end;
+}
+
+/*
+ * Prepares a wavefront over the given passes of the plan. Matrices of every pass of the wavefront are
+ * queued, even past MATRIX_BUDGET, as its passes transform at the same time.
+ */
+wavefront *init_wavefront(cipher *c, pass_plan *plan, int first, int end) {
+  wavefront *w = (wavefront *)malloc(sizeof(wavefront));
+  long num_tiles = c->file_len / WAVE_TILE + (c->file_len % WAVE_TILE > 0 ? 1 : 0);
+  wave_tile *tiles = (wave_tile *)malloc(sizeof(wave_tile) * num_tiles * (end - first));
+  if(!w || !tiles) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_wavefront(), cpme.c."); exit(EXIT_FAILURE);
   }
-  if(c->file_len > dimension) {
-    long calculations_per_chunk = c->file_len / dimension / num_threads;
-    chunk_size = calculations_per_chunk * dimension;
-    for(chunk_index = 0; chunk_index < (num_threads - 1); chunk_index++) {
-      if((chunk_index * chunk_size) + chunk_size > c->file_len) {
-        break;
+  w->ciph = c;
+  w->plan = plan;
+  w->first = first;
+  w->end = end;
+  w->num_tiles = num_tiles;
+  // Enough tiles in flight to keep every thread busy while the wave crosses every pass
+  w->lag = 2 * ((long)c->pool->num_threads + (end - first));
+  w->tiles = tiles;
+  w->running = create_task_group();
+  for(int pass_index = first; pass_index < end; pass_index++) {
+    pass *p = &plan->passes[pass_index];
+    dim_stream stream;
+    if(p->layout) {
+      init_dim_stream(&stream, p->key_val, p->layout->sequence_length);
+    }
+    long chunk = 0;
+    long offset = 0;
+    for(long tile = 0; tile < num_tiles; tile++) {
+      wave_tile *wt = &tiles[(pass_index - first) * num_tiles + tile];
+      wt->wave = w;
+      wt->pass_index = pass_index;
+      wt->tile = tile;
+      // Chunks are walked once for every tile of the pass
+      if(p->layout) {
+        while(chunk < p->layout->num_chunks && offset < tile * WAVE_TILE) {
+          offset += variable_dimension(map_index_at(&stream, chunk));
+          chunk++;
+        }
+      } else {
+        chunk = (tile * WAVE_TILE + p->dimension - 1) / p->dimension;
+        offset = chunk * p->dimension;
       }
-      // Acquire available thread
-      sem_wait(thread_sema);
-      pthread_t thread;
-      fixed_transform_thread *ftt = (fixed_transform_thread *)malloc(sizeof(fixed_transform_thread));
-      if(!ftt) {
-        fatal(LOG_OUTPUT, "Dynamic memory allocation error in fixed_thread_scheduler(), cpme.c.");
-        exit(EXIT_FAILURE);
+      wt->first_chunk = chunk;
+      wt->first_offset = offset;
+      if(pass_index == first) {
+        wt->pending = tile >= w->lag ? 1 : 0;
+      } else {
+        wt->pending = 1 + (tile > 0 ? 1 : 0) + (tile < num_tiles - 1 ? 1 : 0);
       }
-      ftt->dimension = dimension;
-      ftt->offset = chunk_size * chunk_index;
-      ftt->length = chunk_size;
-      ftt->coeff = coeff;
-      ftt->ciph = c;
-      scheduled_chunks += 1;
-      pthread_create(&thread, NULL, fixed_thread_func, (void *)ftt);
     }
+  }
+  while(plan->num_submitted < end) {
+    submit_next_pass(c, plan);
+  }
+  return w;
+}
+
+/*
+ * Transforms the chunks of the pass which start in the tile, then releases the tile transforms
+ * waiting for it.
+ */
+void *wave_tile_func(void *args) {
+  wave_tile *wt = (wave_tile *)args;
+  wavefront *w = wt->wave;
+  cipher *c = w->ciph;
+  pass *p = &w->plan->passes[wt->pass_index];
+  unsigned char scratch[MAX_DIMENSION + KERNEL_PADDING];
+  dim_stream stream;
+  if(p->layout) {
+    init_dim_stream(&stream, p->key_val, p->layout->sequence_length);
+  }
+  long num_chunks = p->layout ? p->layout->num_chunks : c->file_len / p->dimension;
+  long tile_start = wt->tile * WAVE_TILE;
+  long tile_end = tile_start + WAVE_TILE < c->file_len ? tile_start + WAVE_TILE : c->file_len;
+  long chunk = wt->first_chunk;
+  long working_offset = wt->first_offset;
+  long loaded = 0;
+  for(; chunk < num_chunks && working_offset < tile_end; chunk++) {
+    // Fixed dimension matrix stored in permut_map index 1
+    int map_index = p->layout ? map_index_at(&stream, chunk) : 1;
+    int dimension = p->layout ? variable_dimension(map_index) : p->dimension;
+    if(working_offset + dimension > loaded) {
+      loaded = wait_loaded(c, working_offset + dimension);
+    }
+    permut_cipher(c, pass_mat(p, map_index), p->integrity_check, working_offset, scratch);
+    working_offset += dimension;
+  }
+  // Last chunk of arbitrary size, if it starts in the tile, stored in index 10 if variable, 2 if fixed
+  if(chunk == num_chunks && working_offset < c->file_len && working_offset >= tile_start &&
+     working_offset < tile_end) {
+    wait_loaded(c, c->file_len);
+    permut_cipher(c, pass_mat(p, p->layout ? 10 : 2), p->integrity_check, working_offset, scratch);
+    working_offset = c->file_len;
+  }
+  if(c->write_fd >= 0 && wt->pass_index == w->end - 1 && working_offset > wt->first_offset) {
+    write_chunks(c, wt->first_offset, working_offset - wt->first_offset);
+  }
+  if(wt->pass_index == w->end - 1) {
+    release_tile(w, w->first, wt->tile + w->lag);
   } else {
-    chunk_size = c->file_len;
-    chunk_index = 0;
-  }
-  // Schedule last thread
-  sem_wait(thread_sema);
-  pthread_t thread;
-  fixed_transform_thread *ftt = (fixed_transform_thread *)malloc(sizeof(fixed_transform_thread));
-  if(!ftt) {
-    fatal(LOG_OUTPUT, "Dynamic memory allocation error in fixed_thread_scheduler(), cpme.c.");
-    exit(EXIT_FAILURE);
+    for(long tile = wt->tile - 1; tile <= wt->tile + 1; tile++) {
+      release_tile(w, wt->pass_index + 1, tile);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Marks one of the tile transforms the given tile transform waits for as finished, and queues it
+ * if it was the last. Tiles outside the file are ignored.
+ */
+void release_tile(wavefront *w, int pass_index, long tile) {
+  if(tile < 0 || tile >= w->num_tiles) {
+    return;
   }
-  ftt->dimension = dimension;
-  ftt->offset = chunk_size * chunk_index;
-  // Last thread takes arbitrary chunk size to eof
-  ftt->length = c->file_len - ftt->offset;
-  ftt->coeff = coeff;
-  ftt->ciph = c;
-  scheduled_chunks += 1;
-  pthread_create(&thread, NULL, fixed_thread_func, (void *)ftt);
-  // Wait for all threads to finish
-  pthread_mutex_lock(cipher_lock);
-  while(finished_chunks < scheduled_chunks) {
-    pthread_cond_wait(condvar, cipher_lock);
+  wave_tile *wt = &w->tiles[(pass_index - w->first) * w->num_tiles + tile];
+  if(__atomic_sub_fetch(&wt->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    submit_task(w->ciph->pool, w->running, wave_tile_func, (void *)wt);
   }
-  pthread_mutex_unlock(cipher_lock);
 }
 
 /*
- * Facilitates matrix transformations.
+ * Executes the passes of the wavefront on the file held in file_bytes. If an input file is given,
+ * it is read into file_bytes while the tiles read are transformed. The last pass of the plan writes
+ * its tiles to the output, if open.
  */
-void permut_cipher(cipher *c, int map_index, long ref) {
-  unsigned char *data = c->file_bytes;
-  struct PMAT *permutation_mat = c->permut_map[map_index];
-  if(!permutation_mat) {
-    fatal(LOG_OUTPUT, "Null reference to permutation matrix in permut_cipher(), cpme.c.");
-    exit(EXIT_FAILURE);
+void execute_wavefront(cipher *c, wavefront *w, FILE *in) {
+  if(verbose_lvl_2) {
+    printf("Performing linear transformations over %ld tiles...\n", w->num_tiles);
   }
-  int dimension = permutation_mat->dimension;
-  unsigned char *data_in = (unsigned char *)calloc((size_t)dimension + 1, sizeof(unsigned char));
-  memcpy(data_in, data+ref, (size_t)sizeof(unsigned char)*dimension);
-  double *result = transform_vec(dimension, data_in, permutation_mat, c->integrity_check);
-  //check for data preservation error
-  if(result == NULL) {
-    char message[BUFFER];
-    snprintf(message, BUFFER, "%s\n%ld%s\n%s\n", "Corruption detected in encryption.", c->bytes_remaining,
-             " unencrypted bytes remaining.", "Aborting.");
-    fatal(c->log_path, message);
-  }
-  double *ptr = result;
-  unsigned char *data_result = (unsigned char *)realloc(data_in, sizeof(unsigned char)*(dimension + 1));
-  memset(data_result, '\0', (size_t)dimension + 1);
-  for(int i = 0; i < dimension; i++, ptr++) {
-    data_result[i] = (unsigned char)*ptr;
-  }
-  memcpy(data+ref, data_result, (size_t)dimension);
-  free(data_result);
-  free(result);
-  c->bytes_processed += dimension;
-  c->bytes_remaining -= dimension;
+  c->bytes_remaining = c->file_len * (w->end - w->first);
+  c->bytes_processed = 0;
+  // Only the last pass of the wavefront writes its tiles
+  c->write_fd = w->end == w->plan->num_passes ? c->output_fd : -1;
+  // Queued after the matrices of every pass, so tiles never wait on a matrix which is not queued
+  for(long tile = 0; tile < w->num_tiles && tile < w->lag; tile++) {
+    submit_task(c->pool, w->running, wave_tile_func, (void *)&w->tiles[tile]);
+  }
+  if(in) {
+    read_input(c, in);
+  }
+  wait_task_group(w->running);
+  c->write_fd = -1;
 }
 
-// Matrix operations -------------------------------------------------------------------------------
+/*
+ * Frees given wavefront once executed.
+ */
+void free_wavefront(wavefront *w) {
+  free_task_group(w->running);
+  free(w->tiles);
+  free(w);
+}
+
+// Chunk layout ------------------------------------------------------------------------------------
 
 /*
- * Allocates space for a matrix object.
+ * Sums the byte lengths of the chunks in a range of layout blocks.
  */
-struct PMAT *init_permut_mat(int dimension) {
-  //initialize new matrix object
-  struct PMAT_I *mi = (struct PMAT_I *)malloc(sizeof(struct PMAT_I) + sizeof(int)*(dimension));
-  //size is N columns + 1 as required by cc_mv matrix multiplication
-  struct PMAT_I *mj = (struct PMAT_I *)malloc(sizeof(struct PMAT_I) + sizeof(int)*(dimension + 1));
-  struct PMAT_V *mv = (struct PMAT_V *)malloc(sizeof(struct PMAT_V) + sizeof(double)*(dimension));
-  struct PMAT *m = (struct PMAT *)malloc(sizeof(struct PMAT));
-  m->dimension = dimension;
-  m->i = mi;
-  m->j = mj;
-  m->v = mv;
-  m->check_vec_bef = (double *)calloc((size_t) dimension, sizeof(double));
-  m->check_vec_aft = (double *)calloc((size_t) dimension, sizeof(double));
-  return m;
+void *layout_thread_func(void *args) {
+  if(!args) {
+    fatal(LOG_OUTPUT, "Null args reference in layout_thread_func(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  layout_thread *lt = (layout_thread *)args;
+  dim_stream stream;
+  init_dim_stream(&stream, lt->key_val, lt->layout->sequence_length);
+  for(int i = 0; i < PERMUT_MAP_SIZE; i++) {
+    lt->first_use[i] = LONG_MAX;
+  }
+  for(long block = lt->block_start; block < lt->block_end; block++) {
+    long length = 0;
+    long first = block * LAYOUT_BLOCK;
+    for(long chunk = first; chunk < first + LAYOUT_BLOCK; chunk++) {
+      int map_index = map_index_at(&stream, chunk);
+      if(lt->first_use[map_index] == LONG_MAX) {
+        lt->first_use[map_index] = chunk;
+      }
+      length += variable_dimension(map_index);
+    }
+    lt->block_lengths[block] = length;
+  }
+  return NULL;
 }
 
 /*
- * Fetches a node from the given linked list and deletes node from the list.
- * Takes whether the list is the row or column list and the node index.
- * Returns the number corresponding to the node in question.
+ * Lays out the variable dimension chunks of the file for the given key value. Chunks are taken
+ * from the dimension sequence while more than MAX_DIMENSION bytes remain, the rest of the file forms
+ * the last chunk of arbitrary size. Block lengths are summed in parallel, then prefix summed into the
+ * offset of every block. Also finds the first chunk using each matrix.
  */
-int pull_node(node **head, int count, permut_thread *pt) {
-  node *cur = *head;
-  for(int i = 0; i < count; ++i) {
-    cur = cur->next;
+chunk_layout *build_chunk_layout(cipher *c, int key_val) {
+  chunk_layout *layout = (chunk_layout *)malloc(sizeof(chunk_layout));
+  if(!layout) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in build_chunk_layout(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  long file_len = c->file_len;
+  layout->sequence_length = file_len / MAX_DIMENSION;
+  // Every chunk is at least half of MAX_DIMENSION long
+  long max_chunks = file_len / (MAX_DIMENSION / 2) + 1;
+  long max_blocks = max_chunks / LAYOUT_BLOCK + 1;
+  layout->offsets = (long *)malloc(sizeof(long) * (max_blocks + 1));
+  long *block_lengths = (long *)malloc(sizeof(long) * max_blocks);
+  if(!layout->offsets || !block_lengths) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in build_chunk_layout(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  // Only blocks which can start before the last chunk need summing
+  long limit = file_len - MAX_DIMENSION;
+  long used_blocks = limit > 0 ? (limit / (MAX_DIMENSION / 2)) / LAYOUT_BLOCK + 1 : 0;
+  task_group *blocks = create_task_group();
+  long per_thread = used_blocks / num_threads + 1;
+  long num_tasks = (used_blocks + per_thread - 1) / per_thread;
+  layout_thread *tasks = (layout_thread *)malloc(sizeof(layout_thread) * (num_tasks + 1));
+  if(!tasks) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in build_chunk_layout(), cpme.c."); exit(EXIT_FAILURE);
   }
-  if(!cur) {
-    fatal(LOG_OUTPUT, "Linked list null pointer reference in remove_node, util.c."); exit(-1);
+  for(long i = 0; i < num_tasks; i++) {
+    layout_thread *lt = &tasks[i];
+    long start = i * per_thread;
+    lt->key_val = key_val;
+    lt->layout = layout;
+    lt->block_lengths = block_lengths;
+    lt->block_start = start;
+    lt->block_end = start + per_thread < used_blocks ? start + per_thread : used_blocks;
+    submit_task(c->pool, blocks, layout_thread_func, (void *)lt);
+  }
+  wait_task_group(blocks);
+  free_task_group(blocks);
+  for(int i = 0; i < PERMUT_MAP_SIZE; i++) {
+    layout->first_use[i] = LONG_MAX;
+    for(long t = 0; t < num_tasks; t++) {
+      layout->first_use[i] = tasks[t].first_use[i] < layout->first_use[i] ? tasks[t].first_use[i]
+                                                                          : layout->first_use[i];
+    }
+  }
+  free(tasks);
+  // Prefix sum up to the block in which the remaining bytes drop to MAX_DIMENSION or less
+  long block = 0;
+  layout->offsets[0] = 0;
+  while(block < used_blocks && layout->offsets[block] + block_lengths[block] < limit) {
+    layout->offsets[block + 1] = layout->offsets[block] + block_lengths[block];
+    block++;
+  }
+  free(block_lengths);
+  // Walk the final block chunk by chunk
+  long offset = layout->offsets[block];
+  long chunk = block * LAYOUT_BLOCK;
+  dim_stream stream;
+  init_dim_stream(&stream, key_val, layout->sequence_length);
+  while(offset < limit) {
+    int map_index = map_index_at(&stream, chunk);
+    if(chunk < layout->first_use[map_index]) {
+      layout->first_use[map_index] = chunk;
+    }
+    offset += variable_dimension(map_index);
+    chunk++;
   }
-  int num = cur->number;
-  remove_node(head, cur);
-  //free the node later
-  pt->trash[pt->trash_index] = cur;
-  pt->trash_index += 1;
-  return num;
+  // Blocks were summed past the last chunk, uses beyond it do not count
+  for(int i = 0; i < PERMUT_MAP_SIZE; i++) {
+    if(layout->first_use[i] >= chunk) {
+      layout->first_use[i] = -1;
+    }
+  }
+  layout->num_chunks = chunk;
+  layout->chunks_len = offset;
+  layout->tail = (int)(file_len - offset);
+  // Last chunk is used after every other chunk
+  layout->first_use[10] = layout->tail > 0 ? chunk : -1;
+  layout->num_blocks = chunk > block * LAYOUT_BLOCK ? block + 1 : block;
+  layout->offsets[layout->num_blocks] = offset;
+  return layout;
+}
+
+/*
+ * Returns the byte offset of the given chunk, or of the end of the chunks if it is num_chunks.
+ */
+long chunk_offset(chunk_layout *layout, dim_stream *stream, long chunk) {
+  if(chunk >= layout->num_chunks) {
+    return layout->chunks_len;
+  }
+  long block = chunk / LAYOUT_BLOCK;
+  long offset = layout->offsets[block];
+  for(long i = block * LAYOUT_BLOCK; i < chunk; i++) {
+    offset += variable_dimension(map_index_at(stream, i));
+  }
+  return offset;
+}
+
+/*
+ * Frees given chunk layout.
+ */
+void free_chunk_layout(chunk_layout *layout) {
+  free(layout->offsets);
+  free(layout);
+}
+
+// Matrix operations -------------------------------------------------------------------------------
+
+/*
+ * Allocates space for a matrix object.
+ */
+struct PMAT *init_permut_mat(int dimension) {
+  struct PMAT *m = (struct PMAT *)malloc(sizeof(struct PMAT) + sizeof(pmat_index)*dimension);
+  if(!m) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_permut_mat(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  m->dimension = dimension;
+  m->permute = active_kernel->permute;
+  return m;
 }
 
 /*
@@ -477,265 +1266,287 @@ void *permut_thread_func(void *args) {
     fatal(LOG_OUTPUT, "Null args reference in thread_func(), cpme.c."); exit(EXIT_FAILURE);
   }
   permut_thread *pt = (permut_thread *)args;
-  pt->trash = init_ll_trash(pt->dimension);
-  pt->trash_index = 0;
   gen_permut_mat(pt);
-  empty_trash(pt->trash, pt->trash_index);
-  free_ll_trash(pt->trash);
-  dim_finished ++;
-  pthread_cond_broadcast(condvar);
   if(verbose_lvl_2) {
     printf("Finished matrix: %d\n", pt->dimension);
   }
-  if(pt->post) {
-    // Make new thread available
-    sem_post(thread_sema);
-    pthread_detach(pthread_self());
-  }
   free(pt);
   return NULL;
 }
 
 /*
- * Creates threads to generate permutation matrices for linear transformations of 9 variable sizes.
+ * Returns the dimension of the pass's matrix at the given permut_map index, 0 if the pass does not
+ * use one. Variable dimension passes only use the dimensions their chunk layout refers to.
  */
-void gen_variable_permut_mats(cipher *c, int coeff) {
-  // 10 slots for perumation matrices, 9 mapped to base 10 digits 1-9 + one extra for last
-  // matrix of arbitrary size
-  dim_array = (int *)calloc(11, sizeof(int));
-  if(!dim_array) {
-    fatal(LOG_OUTPUT, "Dynamic memory allocation error in gen_variable_permut_mats(), cpme.c.");
-    exit(EXIT_FAILURE);
+int mat_dimension(cipher *c, pass *p, int index) {
+  if(p->layout) {
+    // 9 perumation matrices mapped to base 10 digits 1-9, last matrix of arbitrary size in index 10
+    if(index == 10) {
+      return p->layout->tail;
+    }
+    return index >= 1 && index <= 9 && p->layout->first_use[index] >= 0 ? variable_dimension(index) : 0;
   }
-  dim_array_size = 10;
-  // 'finished' matrix in 0 index
-  dim_finished = 1;
-  dim_index = 1;
-  for(int i = 1; i < 10; i++) {
-    dim_array[i] = i > 1 ? MAX_DIMENSION - (MAX_DIMENSION / i) : MAX_DIMENSION;
+  // Fixed dimension stored in 1st index, last dimension stored in 2nd index, nothing in 0th
+  if(index == 1) {
+    return p->dimension;
   }
+  return index == 2 ? (int)(c->file_len % p->dimension) : 0;
+}
+
+/*
+ * Returns the bytes of memory taken by the pass's matrices.
+ */
+long pass_mat_bytes(cipher *c, pass *p) {
+  long bytes = 0;
+  for(int i = 0; i < PERMUT_MAP_SIZE; i++) {
+    int dimension = mat_dimension(c, p, i);
+    if(dimension > 0) {
+      bytes += (long)(sizeof(struct PMAT) + sizeof(pmat_index) * dimension);
+    }
+  }
+  return bytes;
+}
+
+/*
+ * Queues a task on the cipher's thread pool which generates the pass's permutation matrix of the
+ * given dimension into the given permut_map index.
+ */
+void submit_permut_mat(cipher *c, pass *p, int index, int dimension) {
+  permut_thread *pt = (permut_thread *)malloc(sizeof(permut_thread));
+  if(!pt) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in submit_permut_mat(), cpme.c.");
+    exit(EXIT_FAILURE);
+  }
+  pt->index = index;
+  pt->dimension = dimension;
+  pt->p = p;
+  submit_task(c->pool, p->mats, permut_thread_func, (void *)pt);
+}
+
+/*
+ * Queues the generation of the pass's permutation matrices for linear transformations of the
+ * variable sizes its chunks use and the last chunk. Returns without waiting, every matrix is
+ * published as it is finished. Matrices are queued in the order the file first uses them.
+ */
+void submit_variable_permut_mats(cipher *c, pass *p) {
   if(verbose_lvl_2) {
     printf("Generating matrices...\n");
   }
-  // Generate permutation matrices in parallel
-  while(dim_index < dim_array_size) {
-    // Wait until a thread is available
-    sem_wait(thread_sema);
-    permut_thread *pt = (permut_thread *)malloc(sizeof(permut_thread));
-    pt->index = dim_index;
-    pt->dimension = dim_array[dim_index];
-    pt->c = c;
-    pt->inverse = coeff < 0;
-    pt->post = true;
-    pthread_t thread;
-    pthread_create(&thread, NULL, permut_thread_func, (void *) pt);
-    dim_index += 1;
+  long rank[PERMUT_MAP_SIZE];
+  int order[PERMUT_MAP_SIZE];
+  int num_mats = 0;
+  for(int i = 1; i < PERMUT_MAP_SIZE; i++) {
+    if(mat_dimension(c, p, i) == 0) {
+      continue;
+    }
+    rank[i] = p->layout->first_use[i];
+    // Insertion sort by first use
+    int k = num_mats++;
+    while(k > 0 && rank[i] < rank[order[k - 1]]) {
+      order[k] = order[k - 1];
+      k--;
+    }
+    order[k] = i;
   }
-  pthread_mutex_lock(cipher_lock);
-  while(dim_finished < dim_array_size) {
-    pthread_cond_wait(condvar, cipher_lock);
+  for(int k = 0; k < num_mats; k++) {
+    int i = order[k];
+    submit_permut_mat(c, p, i, mat_dimension(c, p, i));
   }
-  pthread_mutex_unlock(cipher_lock);
-  free(dim_array);
 }
 
 /*
- * Creates threads to generate permutation matrices for linear transformations of size of the given dimension.
+ * Queues the generation of the pass's permutation matrices for linear transformations of size of its
+ * dimension. Returns without waiting, the pass's task group completes once all exist.
  */
-void gen_fixed_permut_mats(cipher *c, int coeff, int dimension) {
-  // Fixed dimension stored in 1st index, last dimension stored in 2nd index, nothing in 0th
-  int last_dim = (int)((c->file_len) % dimension);
-  dim_array_size = last_dim > 0 ? 3 : 2;
-  dim_array = (int *)calloc((size_t)dim_array_size, sizeof(int));
-  if(!dim_array) {
-    fatal(LOG_OUTPUT, "Dynamic memory allocation error in gen_fixed_permut_mats(), cpme.c.");
-    exit(EXIT_FAILURE);
-  }
-  dim_array[1] = dimension;
-  dim_array[2] = last_dim;
-  dim_finished = 1;
-  dim_index = 1;
+void submit_fixed_permut_mats(cipher *c, pass *p) {
   if(verbose_lvl_2) {
     printf("Generating matrices...\n");
   }
-  // Generate permutation matrices in parallel
-  while(dim_index < dim_array_size) {
-    // Wait until a thread is available
-    sem_wait(thread_sema);
-    permut_thread *pt = (permut_thread *)malloc(sizeof(permut_thread));
-    pt->index = dim_index;
-    pt->dimension = dim_array[dim_index];
-    pt->c = c;
-    pt->inverse = coeff < 0;
-    pt->post = true;
-    pthread_t thread;
-    pthread_create(&thread, NULL, permut_thread_func, (void *) pt);
-    dim_index += 1;
-  }
-  pthread_mutex_lock(cipher_lock);
-  while(dim_finished < dim_array_size) {
-    pthread_cond_wait(condvar, cipher_lock);
+  for(int i = 1; i <= 2; i++) {
+    int dimension = mat_dimension(c, p, i);
+    if(dimension > 0) {
+      submit_permut_mat(c, p, i, dimension);
+    }
   }
-  pthread_mutex_unlock(cipher_lock);
-  free(dim_array);
 }
 
 /*
- * Takes the dimension of the matrix to create (dimension is negative if inverse).
- * Generates unique n-dimensional permutation matrices from the encryption key.
+ * Takes the dimension of the matrix to create. Generates unique n-dimensional permutation matrices
+ * from the encryption key, transposed (equal to the matrix inverse) when decrypting.
  */
 void gen_permut_mat(permut_thread *pt) {
   clock_t start = clock();
-  cipher *c = pt->c;
   int dimension = pt->dimension;
-  boolean inverse = pt->inverse;
+  boolean inverse = pt->p->inverse;
   if(verbose_lvl_2) {
     printf("%s%d\n", "Generating matrix: ", dimension);
   }
-  char *linked = gen_linked_vals(c, 2*dimension);
-  //create linked lists used to build matrices
-  node *i_head = (node *)malloc(sizeof(node));
-  i_head->last = NULL;
-  i_head->number = 0;
-  i_head->next = build_ll(i_head, dimension);
-  node *j_head = (node *)malloc(sizeof(node));
-  j_head->last = NULL;
-  j_head->number = 0;
-  j_head->next = build_ll(j_head, dimension);
+  char *linked = gen_linked_vals(pt->p->key_val, 2*dimension);
+  //create order statistic trees of the unused row and column indexes used to build matrices
+  order_tree *i_tree = init_order_tree(dimension);
+  order_tree *j_tree = init_order_tree(dimension);
   //create permutation matrix
-  double acc[dimension];
-  int icc[dimension];
-  int jcc[dimension+1];
   struct PMAT *m = init_permut_mat(dimension);
-  int dimension_counter = 0;
   int list_len = dimension;
   clock_t p_loop = clock();
   int i_val;
   int j_val;
   for(int k = 0; k < 2*dimension; k+=2) {
-    acc[dimension_counter] = 1.0;
     if(list_len == 1) {
-      i_val = pull_node(&i_head, 0, pt);
-      j_val = pull_node(&j_head, 0, pt);
+      i_val = pull_index(i_tree, 0);
+      j_val = pull_index(j_tree, 0);
     } else {
       int row = (charAt(linked, k)-'0');
       row = ((row+1) * dimension) % list_len;
-      i_val = pull_node(&i_head, row, pt);
+      i_val = pull_index(i_tree, row);
       int column = (charAt(linked, k+1)-'0');
       column = ((column+1) * dimension) % list_len;
-      j_val = pull_node(&j_head, column, pt);
-      dimension_counter++;
+      j_val = pull_index(j_tree, column);
       list_len--;
     }
-    //put index values in array using compressed-column format
-    //row index values in order by column
-    icc[j_val] = i_val;
-    //column indexes
-    jcc[j_val] = j_val;
-    m->check_vec_bef[j_val] = (double) j_val;
-  }
-  //todo segfault without this line????
-  jcc[dimension] = dimension;
+    //the matrix holds a 1 at row i_val, column j_val, its transpose at row j_val, column i_val.
+    //store the column index by row of the matrix applied
+    if(inverse) {
+      m->index[j_val] = (pmat_index)i_val;
+    } else {
+      m->index[i_val] = (pmat_index)j_val;
+    }
+  }
+  free_order_tree(i_tree);
+  free_order_tree(j_tree);
   free(linked);
   clock_t p_loop_diff = clock() - p_loop;
-  time_p_loop += p_loop_diff;
+  __atomic_add_fetch(&time_p_loop, p_loop_diff, __ATOMIC_RELAXED);
   clock_t difference = clock() - start;
-  time_total_gen += difference;
+  __atomic_add_fetch(&time_total_gen, difference, __ATOMIC_RELAXED);
   //put permutation matrix in cipher dictionary
   clock_t start_write = clock();
-  memcpy(m->i->icc, icc, sizeof(int)*dimension);
-  memcpy(m->j->icc, jcc, sizeof(int)*(dimension+1));
-  memcpy(m->v->acc, acc, sizeof(double)*dimension);
-  struct PMAT *resultant_m;
-  if(inverse) {
-    resultant_m = orthogonal_transpose(m);
-  } else {
-    resultant_m = m;
-  }
-  c->permut_map[pt->index] = resultant_m;
-  //create vector to check integrity of data
-  if(c->integrity_check) {
-    double *check_vec = cc_mv(dimension, dimension, dimension, resultant_m->i->icc, resultant_m->j->icc,
-                              resultant_m->v->acc, resultant_m->check_vec_bef);
-    memcpy(resultant_m->check_vec_aft, check_vec, sizeof(double)*dimension);
-    free(check_vec);
-  }
+  publish_mat(pt->p, pt->index, m);
   clock_t diff_write = clock() - start_write;
-  time_total_write += diff_write;
+  __atomic_add_fetch(&time_total_write, diff_write, __ATOMIC_RELAXED);
   //printf("created mat, %d\n", dimension);
   //return resultant_m;
 }
 
 /*
- * Takes the matrix dimension, a list of bytes from the file and relevant permutation matrix.
- * Performs the linear transformation operation on the byte vector and returns the resulting vector.
+ * Takes the matrix dimension, an output and input byte vector and the relevant permutation matrix.
+ * Performs the linear transformation operation on the input vector, writing the resulting vector to
+ * the output. Returns false if the data integrity check fails.
  */
-double *transform_vec(int dimension, unsigned char bytes[], struct PMAT *pm, boolean integrity_check) {
-  double vec[dimension];
-  for(int i = 0; i < dimension; i++) {
-    vec[i] = bytes[i];
-  }
+boolean transform_vec(int dimension, unsigned char out[], unsigned char in[], struct PMAT *pm,
+                      integrity_mode integrity_check) {
   clock_t transform_start = clock();
+  permute_bytes(out, in, pm);
+  clock_t transform_diff = clock() - transform_start;
+  __atomic_add_fetch(&time_transformation, transform_diff, __ATOMIC_RELAXED);
   // Data integrity check
-  double *result = cc_mv(dimension, dimension, dimension, pm->i->icc, pm->j->icc, pm->v->acc, vec);
-  if(integrity_check) {
-    int dot_bef = dot_product(vec, pm->check_vec_bef, dimension);
-    clock_t transform_diff = clock() - transform_start;
-    time_transformation += transform_diff;
-    int dot_aft = dot_product(result, pm->check_vec_aft, dimension);
-    return dot_bef == dot_aft ? result : NULL;
+  if(integrity_check == CHECK_DOT) {
+    return check_integrity(dimension, out, in, pm->index);
+  } else if(integrity_check == CHECK_MULTISET) {
+    return check_multiset(dimension, out, in);
   }
-  clock_t transform_diff = clock() - transform_start;
-  time_transformation += transform_diff;
-  return result;
+  return true;
+}
+
+/*
+ * Multiplies the byte vector in by the permutation matrix with the given column indexes by row.
+ * Every row holds a single 1, so the product gathers each byte from the column of its row:
+ * out[i] = in[index[i]]. Runs the kernel chosen for the CPU when the matrix was allocated, in must
+ * be followed by KERNEL_PADDING readable bytes.
+ */
+void permute_bytes(unsigned char out[], unsigned char in[], struct PMAT *pm) {
+  pm->permute(pm->dimension, out, in, pm->index);
 }
 
 /*
- * Takes an orthogonal matrix object and transposes it (equal to the matrix inverse).
- * Returns the resulting matrix object.
+ * Takes the output and input byte vectors of a transformation and the column indexes of the matrix
+ * used. Compares the dot product of the input moved to their transformed rows with the row numbers
+ * to the dot product of the output with the same row numbers.
+ * Returns true if the two match.
  */
-struct PMAT *orthogonal_transpose(struct PMAT *mat) {
-  int dimension = mat->dimension;
-  struct PMAT *t_m = init_permut_mat(dimension);
-  //switch row and column arrays
-  int *new_icc = mat->j->icc;
-  int *new_jcc = mat->i->icc;
-  int t_icc[dimension];
-  int t_jcc[dimension+1];
+boolean check_integrity(int dimension, unsigned char out[], unsigned char in[], pmat_index index[]) {
+  long dot_bef = 0;
+  long dot_aft = 0;
   for(int i = 0; i < dimension; i++) {
-    t_jcc[new_jcc[i]] = new_jcc[i];
-    t_icc[new_jcc[i]] = new_icc[i];
+    dot_bef += (long)in[index[i]] * i;
+    dot_aft += (long)out[i] * i;
   }
-  t_jcc[dimension] = dimension;
-  memcpy(t_m->i->icc, t_icc, sizeof(int)*dimension);
-  memcpy(t_m->j->icc, t_jcc, sizeof(int)*(dimension+1));
-  memcpy(t_m->v->acc, mat->v->acc, sizeof(double)*dimension);
-  memcpy(t_m->check_vec_bef, mat->check_vec_bef, sizeof(double)*dimension);
-  purge_mat(mat);
-  return t_m;
+  return dot_bef == dot_aft;
 }
 
 /*
- * Takes two column vectors and their dimension.
- * Returns the dot product.
+ * Data integrity check of a composed super-block. Compares the dot product of the gathered input
+ * bytes and their offsets with that of the output.
  */
-int dot_product(double a[], double b[], int dimension) {
-  double result = 0;
-  for(int i = 0; i < dimension; i++) {
-    result += a[i] * b[i];
+boolean check_gather_integrity(long length, unsigned char out[], unsigned char in[], uint32_t gather[]) {
+  long dot_bef = 0;
+  long dot_aft = 0;
+  for(long i = 0; i < length; i++) {
+    dot_bef += (long)in[gather[i]] * i;
+    dot_aft += (long)out[i] * i;
+  }
+  return dot_bef == dot_aft;
+}
+
+/*
+ * Fills byte_hashes with the splitmix64 sequence of a fixed seed, so every run hashes alike.
+ */
+void init_byte_hashes() {
+  uint64_t state = 0;
+  for(int b = 0; b < 256; b++) {
+    state += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    byte_hashes[b] = z ^ (z >> 31);
+  }
+}
+
+/*
+ * Returns the hash of the multiset of the given bytes, the sum of their random values. Equal for
+ * every order of the same bytes.
+ */
+uint64_t multiset_hash(long length, unsigned char bytes[]) {
+  // Independent sums, so consecutive additions do not wait on each other
+  uint64_t sums[4] = {0, 0, 0, 0};
+  long i = 0;
+  for(; i + 4 <= length; i += 4) {
+    sums[0] += byte_hashes[bytes[i]];
+    sums[1] += byte_hashes[bytes[i + 1]];
+    sums[2] += byte_hashes[bytes[i + 2]];
+    sums[3] += byte_hashes[bytes[i + 3]];
+  }
+  for(; i < length; i++) {
+    sums[0] += byte_hashes[bytes[i]];
   }
-  return (int) result;
+  return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+/*
+ * Data integrity check comparing the multiset hashes of the output and input of a transformation.
+ * Returns true if the two match.
+ */
+boolean check_multiset(long length, unsigned char out[], unsigned char in[]) {
+  return multiset_hash(length, in) == multiset_hash(length, out);
+}
+
+/*
+ * Returns true if every byte equals the first. Compares the bytes to themselves shifted by one, which
+ * memcmp() scans with vector loads and leaves at the first difference.
+ */
+boolean uniform_bytes(long length, unsigned char bytes[]) {
+  return length <= 1 || memcmp(bytes, bytes + 1, (size_t)(length - 1)) == 0;
 }
 
 /*
  * zeroes out permutation matrix maps.
  */
-void purge_maps(cipher *c) {
-  for(int i = 1; i < dim_array_size; i++) {
-    struct PMAT *pm = c->permut_map[i];
+void purge_maps(struct PMAT **permut_map) {
+  for(int i = 1; i < PERMUT_MAP_SIZE; i++) {
+    struct PMAT *pm = permut_map[i];
     if(pm) {
       purge_mat(pm);
-      c->permut_map[i] = NULL;
+      permut_map[i] = NULL;
     }
   }
 }
@@ -744,17 +1555,8 @@ void purge_maps(cipher *c) {
  * Zeroes out contents of matrix.
  */
 void purge_mat(struct PMAT *pm) {
-  memset(pm->i->icc, '\0', pm->dimension * sizeof(int));
-  memset(pm->j->icc, '\0', (pm->dimension + 1) * sizeof(int));
-  memset(pm->v->acc, '\0', pm->dimension * sizeof(double));
-  memset(pm->check_vec_bef, '\0', pm->dimension * sizeof(double));
-  memset(pm->check_vec_aft, '\0', pm->dimension * sizeof(double));
+  memset(pm->index, '\0', pm->dimension * sizeof(pmat_index));
   pm->dimension = 0;
-  free(pm->i);
-  free(pm->j);
-  free(pm->v);
-  free(pm->check_vec_bef);
-  free(pm->check_vec_aft);
   free(pm);
 }
 
@@ -781,94 +1583,267 @@ int key_sum(char *s) {
 }
 
 /*
- * Takes cipher object and whether encrypt or decrypt.
- * Reads entire file into the program.
+ * Returns the greatest common divisor of two positive integers.
  */
-unsigned char* read_input(cipher *c) {
-  long file_len = c->file_len;
-  FILE *in;
+long greatest_common_divisor(long a, long b) {
+  while(b != 0) {
+    long r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+/*
+ * Returns the path of the input file.
+ */
+char *input_path(cipher *c) {
   char *f_in_path = (char *)malloc(sizeof(char) * BUFFER);
-  sprintf(f_in_path, "%s%s", c->file_path, c->file_name);
-  in = fopen(f_in_path, "r");
-  unsigned char *file_bytes = (unsigned char *)calloc((size_t)file_len + 1, sizeof(unsigned char));
-  fread(file_bytes, sizeof(unsigned char), (size_t)file_len, in);
-  free(f_in_path);
-  fclose(in);
-  return file_bytes;
+  if(!f_in_path) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in input_path(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  snprintf(f_in_path, BUFFER, "%s%s", c->file_path, c->file_name);
+  return f_in_path;
 }
 
 /*
- * Writes encrypted/decrypted data to file.
+ * Returns the path of the output file. Strips the encrypted extension from the file name when
+ * decrypting, the cipher's file name is left unchanged.
  */
-void write_output(cipher *c, int coeff) {
+char *output_path(cipher *c, int coeff) {
   char *f_out_path = (char *)malloc(sizeof(char) * BUFFER);
+  if(!f_out_path) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in output_path(), cpme.c."); exit(EXIT_FAILURE);
+  }
   char *extension = get_extension(c->file_name);
   char *output_name = strlen(c->output_name) > 0 ? c->output_name : c->file_name;
-  if(coeff > 0) { //encrypt
+  // A rekey writes an encrypted file
+  if(coeff > 0 || c->num_new_instructions > 0) { //encrypt
     // Only add extension to output if it doesn't already exist
     if(strcmp(extension, ENCRYPT_EXT) == 0) {
-      sprintf(f_out_path, "%s%s", c->file_path, c->file_name);
+      snprintf(f_out_path, BUFFER, "%s%s", c->file_path, c->file_name);
     } else {
-      sprintf(f_out_path, "%s%s%s", c->file_path, output_name, ENCRYPT_EXT);
+      snprintf(f_out_path, BUFFER, "%s%s%s", c->file_path, output_name, ENCRYPT_EXT);
     }
   } else { //decrypt
-    // Check if need to remove extension
-    if(strcmp(extension, ENCRYPT_EXT) == 0) {
-      // remove extension
-      remove_extension(c->file_name, ENCRYPT_EXT);
+    char decrypted_name[BUFFER];
+    snprintf(decrypted_name, BUFFER, "%s", output_name);
+    // Remove the extension from a copy of the input's name, a given output name is used as it is
+    if(output_name == c->file_name && strcmp(extension, ENCRYPT_EXT) == 0) {
+      remove_extension(decrypted_name, ENCRYPT_EXT);
     }
-    sprintf(f_out_path, "%s%s%s", c->file_path, DECRYPT_TAG, output_name);
+    if(snprintf(f_out_path, BUFFER, "%s%s%s", c->file_path, DECRYPT_TAG, decrypted_name) >= BUFFER) {
+      fatal(LOG_OUTPUT, "Output path too long in output_path(), cpme.c.");
+    }
+  }
+  return f_out_path;
+}
+
+/*
+ * Opens the input file for reading.
+ */
+FILE *open_input(cipher *c) {
+  char *f_in_path = input_path(c);
+  FILE *in = fopen(f_in_path, "r");
+  if(!in) {
+    fatal(LOG_OUTPUT, "Error opening input file in open_input(), cpme.c.");
   }
-  FILE *out = fopen(f_out_path, "w");
+  free(f_in_path);
+  return in;
+}
+
+/*
+ * Reads entire file into file_bytes, LOAD_BLOCK bytes at a time. Publishes the number of bytes loaded
+ * after every block so transforms can follow the reads.
+ */
+void read_input(cipher *c, FILE *in) {
   long file_len = c->file_len;
-  fwrite(c->file_bytes, sizeof(unsigned char), (size_t)file_len, out);
+  long loaded = 0;
+  while(loaded < file_len) {
+    size_t block = (size_t)(file_len - loaded < LOAD_BLOCK ? file_len - loaded : LOAD_BLOCK);
+    if(fread(c->file_bytes + loaded, sizeof(unsigned char), block, in) != block) {
+      fatal(LOG_OUTPUT, "Error reading input file in read_input(), cpme.c.");
+    }
+    loaded += (long)block;
+    publish_loaded(c, loaded);
+  }
+}
+
+/*
+ * Removes the temporary output file if it has not been renamed into place. Registered with atexit(),
+ * so a run which fails leaves the input and any existing output untouched.
+ */
+void remove_pending_output() {
+  if(strlen(pending_output) > 0) {
+    unlink(pending_output);
+    pending_output[0] = '\0';
+  }
+}
+
+/*
+ * Creates a temporary file next to the output path for encrypted/decrypted data, preallocated to the
+ * length of the file. Returns its descriptor, commit_output() renames it to the output path.
+ */
+int open_output(cipher *c, int coeff) {
+  static boolean cleanup_registered = false;
+  char *f_out_path = output_path(c, coeff);
+  if(!cleanup_registered && atexit(remove_pending_output) != 0) {
+    fatal(LOG_OUTPUT, "Error registering output cleanup in open_output(), cpme.c.");
+  }
+  cleanup_registered = true;
+  if(snprintf(pending_output, BUFFER, "%s.%d.tmp", f_out_path, (int)getpid()) >= BUFFER) {
+    pending_output[0] = '\0';
+    fatal(LOG_OUTPUT, "Output path too long in open_output(), cpme.c.");
+  }
+  int fd = open(pending_output, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if(fd < 0) {
+    pending_output[0] = '\0';
+    fatal(LOG_OUTPUT, "Error opening output file in open_output(), cpme.c.");
+  }
+  if(c->file_len > 0 && posix_fallocate(fd, 0, (off_t)c->file_len) != 0
+     && ftruncate(fd, (off_t)c->file_len) != 0) {
+    // Reserve the file's blocks up front, or at least size it if the file system cannot
+    fatal(LOG_OUTPUT, "Error resizing output file in open_output(), cpme.c.");
+  }
   free(f_out_path);
-  fclose(out);
-  // DEBUG OUTPUT
-  //fclose(debug);
+  return fd;
+}
+
+/*
+ * Closes the temporary output file opened by open_output() and renames it to the output path,
+ * replacing any file there.
+ */
+void commit_output(cipher *c, int coeff, int fd) {
+  char *f_out_path = output_path(c, coeff);
+  if(close(fd) != 0) {
+    fatal(LOG_OUTPUT, "Error closing output file in commit_output(), cpme.c.");
+  }
+  if(rename(pending_output, f_out_path) != 0) {
+    fatal(LOG_OUTPUT, "Error renaming output file in commit_output(), cpme.c.");
+  }
+  pending_output[0] = '\0';
+  free(f_out_path);
+}
+
+/*
+ * Writes the given range of the file from file_bytes to the output at the same offset. Called by the
+ * worker which transformed the range.
+ */
+void write_chunks(cipher *c, long offset, long length) {
+  unsigned char *data = c->file_bytes + (offset - c->window_offset);
+  long done = 0;
+  while(done < length) {
+    ssize_t n = pwrite(c->write_fd, data + done, (size_t)(length - done), (off_t)(offset + done));
+    if(n <= 0) {
+      fatal(c->log_path, "Error writing output in write_chunks(), cpme.c.");
+    }
+    done += n;
+  }
 }
 
 /*
  * Generates a string of pseudo-random values of length provided.
  */
-char *gen_linked_vals(cipher *c, int length) {
+char *gen_linked_vals(int key_val, int length) {
   int sequences = 1;
   if(length > 15) {
     sequences = ((length - (length % 15)) / 15) + 1;
   }
-  //16 is the number of values in the log string
-  char *linked = (char *)calloc((size_t)16 * sequences, sizeof(char));
+  //15 is the number of values in the log string
+  char *linked = (char *)malloc(sizeof(char) * (15 * (size_t)sequences + 1));
+  if(!linked) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in gen_linked_vals(), cpme.c."); exit(EXIT_FAILURE);
+  }
+  double key_log = log(key_val);
   //create string used to choose permutation matrix
-  for(int i = 2; i <= sequences + 1; i++) {
-    //i + dimension = log base
-    char *logBaseOutput = gen_log_base_str(c, (i + length));
-    strncat(linked, logBaseOutput, strlen(logBaseOutput));
-    free(logBaseOutput);
+  for(int i = 0; i < sequences; i++) {
+    //i + 2 + length = log base
+    gen_log_base_digits(key_log, (double)(i + 2 + length), linked + 15 * (size_t)i);
   }
+  linked[15 * (size_t)sequences] = '\0';
   return linked;
 }
 
 /*
- * Generates unique, pseudo-random string of numbers using the encryption key.
+ * Generates unique, pseudo-random string of numbers using the log of the encryption key value.
+ * Writes the first 15 decimals of log(key) / log(log_base), as printed to 16 decimal places, to dest.
+ * The decimals are computed with exact integer arithmetic instead of formatting the value.
  */
-char *gen_log_base_str(cipher *c, double log_base) {
-  double output = log(c->encrypt_key_val) / log(log_base);
-  char *log_base_str = (char *)malloc(sizeof(char) * 32);
-  sprintf(log_base_str, "%.16lf", output);
+void gen_log_base_digits(double key_log, double log_base, char *dest) {
+  double output = key_log / log(log_base);
+  int exponent;
+  double fraction = frexp(output, &exponent);
+#ifdef __SIZEOF_INT128__
+  if(output >= 0 && exponent <= 63) {
+    //output = mantissa * 2^-shift exactly
+    uint64_t mantissa = (uint64_t)ldexp(fraction, 53);
+    int shift = 53 - exponent;
+    uint64_t decimals = 0;
+    if(shift > 0 && shift < 128) {
+      uint128 frac = shift < 64 ? mantissa & (((uint64_t)1 << shift) - 1) : mantissa;
+      //round frac * 10^16 / 2^shift to nearest, ties to even, as printf does
+      uint128 scaled = frac * (uint128)10000000000000000ULL;
+      uint128 rem = scaled & ((((uint128)1) << shift) - 1);
+      uint128 half = ((uint128)1) << (shift - 1);
+      decimals = (uint64_t)(scaled >> shift);
+      if(rem > half || (rem == half && (decimals & 1))) {
+        decimals++;
+      }
+      //rounding up to 1.0 carries into the whole number, leaving zeroes behind the decimal
+      decimals %= 10000000000000000ULL;
+    }
+    //drop 16th decimal, write remaining 15 most significant first
+    decimals /= 10;
+    for(int i = 14; i >= 0; i--) {
+      dest[i] = (char)('0' + decimals % 10);
+      decimals /= 10;
+    }
+    return;
+  }
+#endif
+  char log_base_str[BUFFER];
+  snprintf(log_base_str, BUFFER, "%.16lf", output);
   //gets rid of everything before the decimal
-  char *ch = log_base_str;
-  while(*ch != '.') {
-      ch++;
+  char *ch = strchr(log_base_str, '.') + 1;
+  memcpy(dest, ch, (size_t)15);
+}
+
+/*
+ * Initializes a dimension sequence stream for the given key value. Length is the length of the
+ * digit string the sequence is generated from, as given to gen_linked_vals().
+ */
+void init_dim_stream(dim_stream *stream, int key_val, long length) {
+  long sequences = 1;
+  if(length > 15) {
+    sequences = (length / 15) + 1;
   }
-  ch++;
-  char *final_output = (char *)calloc(32, sizeof(char));
-  strncpy(final_output, ch, (size_t)15);
-  // DEBUG OUTPUT
-//    char *write_debug = (char *)malloc(sizeof(char)*32);
-//    sprintf(write_debug, "%s\n", final_output);
-//    fwrite(write_debug, sizeof(char), strlen(write_debug), debug);
-  free(log_base_str);
-  return final_output;
+  stream->key_log = log(key_val);
+  stream->length = length;
+  stream->period = 15 * sequences;
+  stream->segment = -1;
+}
+
+/*
+ * Returns the permut_map index of the chunk at the given position in the file. Computes the 15 digit
+ * segment holding the chunk's value if it is not already loaded, so sequential reads cost one log
+ * per 15 chunks and any position can be read without computing the ones before it.
+ */
+int map_index_at(dim_stream *stream, long chunk) {
+  long position = chunk % stream->period;
+  long segment = position / 15;
+  if(segment != stream->segment) {
+    gen_log_base_digits(stream->key_log, (double)(segment + 2 + stream->length), stream->digits);
+    stream->segment = segment;
+  }
+  int map_index = stream->digits[position % 15] - '0';
+  return map_index > 1 ? map_index : 1;
+}
+
+/*
+ * Returns the dimension of the variable dimension permutation matrix at the given permut_map index.
+ */
+int variable_dimension(int map_index) {
+  return map_index > 1 ? MAX_DIMENSION - (MAX_DIMENSION / map_index) : MAX_DIMENSION;
 }
 
 // Instructions ------------------------------------------------------------------------------------
@@ -878,7 +1853,11 @@ char *gen_log_base_str(cipher *c, double log_base) {
  * should be fixed (0 = variable dimensions, >=1 = fixed dimension) and the dimension (if fixed)
  * Returns an array of instructions.
  */
-instruction *create_instruction(int dimension, char *encrypt_key, boolean integrity_check) {
+instruction *create_instruction(int dimension, char *encrypt_key, integrity_mode integrity_check) {
+  // Key digits are taken from the log of the key value
+  if(key_sum(encrypt_key) <= 0) {
+    fatal(LOG_OUTPUT, "Encryption key value must be positive. Choose a different key.");
+  }
   instruction *i = (instruction *)malloc(sizeof(instruction));
   i->encrypt_key = (char *)calloc(BUFFER, sizeof(char));
   i->dimension = dimension;
@@ -896,53 +1875,65 @@ void set_instructions(cipher *c, instruction **instructions, int num_instruction
 }
 
 /*
- * Iterates through the instructions of the given cipher.
+ * Sets the instructions a rekey encrypts with, once the file is decrypted with the cipher's
+ * instructions. Run in decrypt mode. Must call before calling run().
  */
-void read_instructions(cipher *c, int coeff) {
-  int num_instructions = c->num_instructions;
-  if(num_instructions == 0) {
-    fatal(LOG_OUTPUT, "No instructions found.");
-  }
-  int a;
-  int b;
-  if(coeff > 0) { //encrypt, read instructions forwards
-    a = 0;
-    b = num_instructions;
-  } else { //coeff < 0, decrypt, read instructions backwards
-    // todo num_instructions & b=0
-    a = -1 * (num_instructions-1);
-    b = 1;
+void set_new_instructions(cipher *c, instruction **instructions, int num_instructions) {
+  c->new_instructions = instructions;
+  c->num_new_instructions = num_instructions;
+}
+
+/*
+ * Iterates through the instructions of the given cipher. If an input file is given, it is read into
+ * file_bytes while the matrices are generated and the first instruction transforms the chunks
+ * already read, otherwise file_bytes must hold the whole file. Runs of fixed dimension instructions
+ * are composed, see compose_end(), and other consecutive instructions overlap, see wave_end().
+ */
+void read_instructions(cipher *c, int coeff, FILE *in) {
+  pass_plan *plan = plan_passes(c, coeff);
+  if(in) {
+    publish_loaded(c, 0);
   }
   //iterate through instructions
-  int pass_index = 1;
-  for(int i = a; i < b; i++, pass_index++) {
-    instruction *cur = c->instructions[abs(i)];
-    c->bytes_remaining = c->file_len;
-    c->bytes_processed = 0;
-    c->integrity_check = cur->integrity_check;
-    //FIXED: dimension cannot be larger than max dimension
-    int dimension = cur->dimension > MAX_DIMENSION ? MAX_DIMENSION : cur->dimension;
-    size_t key_len = strlen(cur->encrypt_key);
-    memcpy(c->encrypt_key, cur->encrypt_key, sizeof(char) * key_len + 1);
-    //memset(cur->encrypt_key, '\0', sizeof(char)*key_len);
-    c->encrypt_key_val = key_sum(c->encrypt_key);
-    printf("Executing instruction %d...\n", pass_index);
-    if(dimension > 0) { //fixed dimension
-      // Generate matrices
-      gen_fixed_permut_mats(c, coeff, dimension);
-      // Perform linear transformations
-      fixed_thread_scheduler(c, coeff, dimension);
-    } else { //flexible dimension
-      // Generate matrices
-      gen_variable_permut_mats(c, coeff);
-      // Perform linear transformations
-      variable_thread_scheduler(c, coeff);
+  int pass_index = 0;
+  while(pass_index < plan->num_passes) {
+    int end = compose_end(c, plan, pass_index);
+    if(end - pass_index > 1) {
+      printf("Executing instructions %d to %d...\n", pass_index + 1, end);
+      composed_pass *cp = init_composed_pass(c, plan, pass_index, end);
+      execute_composed(c, cp, pass_index == 0 ? in : NULL);
+      free_composed_pass(cp);
+      for(; pass_index < end; pass_index++) {
+        retire_pass(c, plan, pass_index);
+      }
+      continue;
+    }
+    end = wave_end(c, plan, pass_index);
+    if(end - pass_index > 1) {
+      printf("Executing instructions %d to %d...\n", pass_index + 1, end);
+      wavefront *w = init_wavefront(c, plan, pass_index, end);
+      execute_wavefront(c, w, pass_index == 0 ? in : NULL);
+      free_wavefront(w);
+      for(; pass_index < end; pass_index++) {
+        retire_pass(c, plan, pass_index);
+      }
+      continue;
+    }
+    pass *p = &plan->passes[pass_index];
+    printf("Executing instruction %d...\n", pass_index + 1);
+    // Last pass writes its chunks to the output, if open, as soon as they are transformed
+    c->write_fd = pass_index == plan->num_passes - 1 ? c->output_fd : -1;
+    // Perform linear transformations
+    transform_loop *loop = start_transform(c, p, 0, p->num_items);
+    if(in && pass_index == 0) {
+      read_input(c, in);
     }
-    // todo move outside of instruction for loop?
-    purge_maps(c);
-    memset(c->encrypt_key, '\0', sizeof(char)*key_len);
-    c->encrypt_key_val = 0;
+    finish_transform(loop);
+    c->write_fd = -1;
+    retire_pass(c, plan, pass_index);
+    pass_index++;
   }
+  free_plan(plan);
 }
 
 /*
@@ -965,7 +1956,8 @@ void print_instruction_at(instruction **instructions, int index) {
   } else {
     printf("variable\n");
   }
-  printf("Data integrity checks: %s\n", ins->integrity_check ? "on" : "off");
+  printf("Data integrity checks: %s\n", ins->integrity_check == CHECK_DOT ? "dot product"
+                                         : ins->integrity_check == CHECK_MULTISET ? "multiset hash" : "off");
   printf("\n");
 }
 
@@ -7,7 +7,11 @@
 #ifndef FONT_BLANC_C_FONTBLANC_H
 #define FONT_BLANC_C_FONTBLANC_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include "util.h"
+#include "thread_pool.h"
+#include "io_queue.h"
 
 // Changes size of largest possible matrix
 #define MAX_DIMENSION 8192
@@ -16,33 +20,43 @@
 #define ENCRYPT_EXT ".fbz"
 #define DECRYPT_TAG "d_"
 #define MAX_INSTRUCTIONS 10
+// 9 variable dimension matrices mapped to base 10 digits 1-9, one for the last chunk and an unused 0
+#define PERMUT_MAP_SIZE 11
+// Number of windows of a streamed file being read, transformed or written at a time
+#define IO_DEPTH 4
+// Bytes of permutation matrices generated ahead of the instructions using them, and of the gather
+// table and scratch copies of a composition. The matrices of the instruction being executed are
+// always generated
+#define MATRIX_BUDGET (8 * 1024 * 1024)
+// Bytes read at a time when loading the file, transforms of the first instruction follow the reads
+#define LOAD_BLOCK (4 * 1024 * 1024)
+// Number of variable dimension chunks summed into each entry of a chunk layout
+#define LAYOUT_BLOCK 4096
+// Largest super-block consecutive fixed dimension instructions are composed over. Its gather table
+// holds 4 bytes per byte of the super-block and every worker holds a copy of one
+#define COMPOSE_BLOCK_MAX (1024 * 1024)
+// Bytes of the file an instruction transforms at a time when consecutive instructions overlap. A chunk
+// starting in a tile may end in the next one, so it must be at least MAX_DIMENSION
+#define WAVE_TILE (128 * 1024)
 
-/*
- * Permutation matrix structure.
- */
-struct PMAT {
-    int dimension;
-    struct PMAT_I *i;
-    struct PMAT_I *j;
-    struct PMAT_V *v;
-    double *check_vec_bef;
-    double *check_vec_aft;
-};
+// Narrowest unsigned type able to hold every index of a MAX_DIMENSION matrix
+#if MAX_DIMENSION <= 65536
+typedef uint16_t pmat_index;
+#else
+typedef uint32_t pmat_index;
+#endif
 
-/*
- * Matrix index structure.
- */
-struct PMAT_I {
-    int dimension;
-    int icc[]; //row/column indexes
-};
+// Gathers out[i] = in[index[i]] for every i below the dimension
+typedef void (*permute_func)(int, unsigned char out[], unsigned char in[], pmat_index index[]);
 
 /*
- * Matrix values structure.
+ * Permutation matrix structure. Every row of a permutation matrix holds a single 1, so the matrix
+ * is stored as the column index of the 1 in each row.
  */
-struct PMAT_V {
+struct PMAT {
     int dimension;
-    double acc[]; //compressed column values
+    permute_func permute; //kernel chosen for the CPU
+    pmat_index index[]; //column index by row
 };
 
 /*
@@ -50,7 +64,7 @@ struct PMAT_V {
  */
 typedef struct instruction {
   int dimension;
-  boolean integrity_check;
+  integrity_mode integrity_check;
   char *encrypt_key;
 } instruction;
 
@@ -58,34 +72,174 @@ typedef struct instruction {
  * Cipher structure.
  */
 typedef struct cipher{
-    struct PMAT **permut_map;
     char *log_path;
     char *file_name;
     char *output_name;
     char *file_path;
-    char encrypt_key[1000];
-    int encrypt_key_val;
     long file_len;
     _Atomic long bytes_remaining;
     _Atomic long bytes_processed;
     unsigned char *file_bytes;
+    // File offset of the first byte of file_bytes, non-zero when streaming the file in windows
+    long window_offset;
+    // Output file of the in memory path, -1 if none
+    int output_fd;
+    // File workers write their chunks to once transformed, -1 if none
+    int write_fd;
+    // Bytes of file_bytes loaded so far, transforms wait for the chunks they need to be loaded
+    _Atomic long loaded;
+    pthread_mutex_t load_lock;
+    pthread_cond_t load_cond;
     instruction **instructions;
     int num_instructions;
-    boolean integrity_check;
+    // Instructions a rekey encrypts with once decrypted with instructions, NULL unless rekeying
+    instruction **new_instructions;
+    int num_new_instructions;
+    // Worker threads shared by every instruction
+    thread_pool *pool;
+    // Scratch copy of the chunk each worker is transforming, reused by every transformation loop
+    unsigned char **scratch;
 } cipher;
 
+/*
+ * Seekable, lazily computed sequence of the variable dimension permut_map indexes of a file's chunks.
+ * Holds one 15 digit segment of the key digit string at a time.
+ */
+typedef struct dim_stream {
+  double key_log;
+  // Length the digit string is generated for, offsets the log base of every segment
+  long length;
+  // Number of digits before the string repeats
+  long period;
+  // Segment currently held in digits, -1 if none
+  long segment;
+  char digits[15];
+} dim_stream;
+
+/*
+ * Chunk layout of a variable dimension instruction. Chunks are grouped into blocks of LAYOUT_BLOCK
+ * consecutive chunks, and the byte offset of the first chunk of every block is stored.
+ */
+typedef struct chunk_layout {
+  // Length of the file's dimension sequence
+  long sequence_length;
+  // Number of variable dimension chunks, excluding the last chunk of arbitrary size
+  long num_chunks;
+  // Byte length covered by the variable dimension chunks
+  long chunks_len;
+  // Size of the last chunk of arbitrary size, 0 if none
+  int tail;
+  long num_blocks;
+  // Offset of the first chunk of every block, followed by chunks_len
+  long *offsets;
+  // First chunk using each permut_map index, -1 if unused
+  long first_use[PERMUT_MAP_SIZE];
+} chunk_layout;
+
+/*
+ * Execution of one instruction, with its matrices and the chunks they are applied to. Items are the
+ * chunks of the file in order, the last chunk of arbitrary size included.
+ */
+typedef struct pass {
+  instruction *ins;
+  // Key value the pass's digit strings are generated from
+  int key_val;
+  integrity_mode integrity_check;
+  // Decrypting, matrices are generated transposed
+  boolean inverse;
+  // Fixed permutation matrix dimension, 0 if variable
+  int dimension;
+  // Variable dimension chunk layout, NULL if fixed
+  chunk_layout *layout;
+  long num_items;
+  // Permutation matrices, indexed as described in submit_variable_permut_mats() and
+  // submit_fixed_permut_mats(). Every slot is published once by its generator, see pass_mat()
+  struct PMAT **permut_map;
+  // Tasks generating the permutation matrices, and the bytes of matrices they generate
+  task_group *mats;
+  long mat_bytes;
+  // Signals workers when a matrix is published
+  pthread_mutex_t mats_lock;
+  pthread_cond_t mat_ready;
+} pass;
+
+/*
+ * Passes of every instruction in execution order. Matrices are generated for the passes from the
+ * current one on while they fit MATRIX_BUDGET.
+ */
+typedef struct pass_plan {
+  pass *passes;
+  int num_passes;
+  // Passes whose matrices have been queued for generation
+  int num_submitted;
+  // Bytes of queued matrices and of the composition being executed not yet freed
+  long resident;
+} pass_plan;
+
+/*
+ * Consecutive fixed dimension passes executed in a single traversal of the file. A super-block of
+ * block_len bytes, the least common multiple of their dimensions, holds whole chunks of every pass,
+ * so the passes compose into one gather table applied to every super-block.
+ */
+typedef struct composed_pass {
+  cipher *ciph;
+  pass_plan *plan;
+  // Passes first to end - 1 of the plan
+  int first;
+  int end;
+  long block_len;
+  // Super-blocks from the start of the file, the bytes after them are transformed pass by pass
+  long num_blocks;
+  // Strongest check of the composed passes
+  integrity_mode integrity_check;
+  // Offset in the super-block of the byte moved to every offset, built once the matrices are
+  uint32_t *gather;
+  task_group *built;
+  // Scratch copy of a super-block for every worker
+  unsigned char **scratch;
+} composed_pass;
+
+/*
+ * Transforms by one pass of a wavefront of the chunks starting in one tile of the file.
+ */
+typedef struct wave_tile {
+  struct wavefront *wave;
+  int pass_index;
+  long tile;
+  // First chunk of the pass starting in the tile or after it, and its offset
+  long first_chunk;
+  long first_offset;
+  // Tile transforms this one waits for, it is queued once none are left
+  int pending;
+} wave_tile;
+
+/*
+ * Consecutive passes executed together over tiles of WAVE_TILE bytes of the file. A pass transforms
+ * a tile once the pass before has transformed the tile and its neighbours, the only tiles its chunks
+ * can overlap, so tiles go through every pass while they are cached. The first pass starts a tile
+ * once the last pass has finished the tile lag tiles before it.
+ */
+typedef struct wavefront {
+  cipher *ciph;
+  pass_plan *plan;
+  // Passes first to end - 1 of the plan
+  int first;
+  int end;
+  long num_tiles;
+  long lag;
+  // Tile transforms of the first pass, followed by those of every following pass
+  wave_tile *tiles;
+  // Queued tile transforms, every tile transform queues those it releases before finishing
+  task_group *running;
+} wavefront;
+
 /*
  * Information for a thread generating a permutation matrix of specified dimension.
  */
 typedef struct permut_thread {
   int index;
   int dimension;
-  node **trash;
-  int trash_index;
-  cipher *c;
-  boolean inverse;
-  // Indicates whether thread should call post on thread counting semaphore and detach upon completion
-  boolean post;
+  pass *p;
 } permut_thread;
 
 // Constructors and Destructors --------------------------------------------------------------------
@@ -94,36 +248,96 @@ int close_cipher(cipher *);
 
 // Core operations ---------------------------------------------------------------------------------
 int run(cipher *, boolean);
-void *variable_thread_func(void *);
-void variable_thread_scheduler(cipher *, int);
-void *fixed_thread_func(void *);
-void fixed_thread_scheduler(cipher *, int, int);
-void permut_cipher(cipher *, int, long);
+long transform_grain(long);
+void variable_range_func(void *, long, long, int);
+void fixed_range_func(void *, long, long, int);
+void permut_cipher(cipher *, struct PMAT *, integrity_mode, long, unsigned char *);
+void publish_loaded(cipher *, long);
+long wait_loaded(cipher *, long);
+
+// Passes ------------------------------------------------------------------------------------------
+instruction *instruction_at(cipher *, int, int);
+void init_pass(cipher *, pass *, instruction *, int);
+pass_plan *plan_passes(cipher *, int);
+void submit_planned(cipher *, pass_plan *);
+void submit_next_pass(cipher *, pass_plan *);
+void retire_pass(cipher *, pass_plan *, int);
+void free_plan(pass_plan *);
+struct transform_loop *start_transform(cipher *, pass *, long, long);
+void finish_transform(struct transform_loop *);
+void transform_pass(cipher *, pass *, long, long);
+long item_length(cipher *, pass *, dim_stream *, long);
+void end_pass(pass *);
+void publish_mat(pass *, int, struct PMAT *);
+struct PMAT *pass_mat(pass *, int);
+void stream_instructions(cipher *, int);
+void map_instructions(cipher *, int);
+
+// Composition -------------------------------------------------------------------------------------
+long composed_bytes(cipher *, long);
+int compose_end(cipher *, pass_plan *, int);
+composed_pass *init_composed_pass(cipher *, pass_plan *, int, int);
+void *gather_thread_func(void *);
+void composed_range_func(void *, long, long, int);
+void execute_composed(cipher *, composed_pass *, FILE *);
+void free_composed_pass(composed_pass *);
+
+// Wavefronts --------------------------------------------------------------------------------------
+int wave_end(cipher *, pass_plan *, int);
+wavefront *init_wavefront(cipher *, pass_plan *, int, int);
+void *wave_tile_func(void *);
+void release_tile(wavefront *, int, long);
+void execute_wavefront(cipher *, wavefront *, FILE *);
+void free_wavefront(wavefront *);
+
+// Chunk layout ------------------------------------------------------------------------------------
+void *layout_thread_func(void *);
+chunk_layout *build_chunk_layout(cipher *, int);
+long chunk_offset(chunk_layout *, dim_stream *, long);
+void free_chunk_layout(chunk_layout *);
 
 // Matrix operations -------------------------------------------------------------------------------
 struct PMAT *init_permut_mat(int);
-int pull_node(node **, int, permut_thread *);
 void *permut_thread_func(void *);
-void gen_variable_permut_mats(cipher *, int);
-void gen_fixed_permut_mats(cipher *, int, int);
+int mat_dimension(cipher *, pass *, int);
+long pass_mat_bytes(cipher *, pass *);
+void submit_permut_mat(cipher *, pass *, int, int);
+void submit_variable_permut_mats(cipher *, pass *);
+void submit_fixed_permut_mats(cipher *, pass *);
 void gen_permut_mat(permut_thread *);
-double *transform_vec(int, unsigned char bytes[], struct PMAT *, boolean);
-struct PMAT *orthogonal_transpose(struct PMAT *);
-int dot_product(double a[], double b[], int);
-void purge_maps(cipher *);
+boolean transform_vec(int, unsigned char out[], unsigned char in[], struct PMAT *, integrity_mode);
+void permute_bytes(unsigned char out[], unsigned char in[], struct PMAT *);
+boolean check_integrity(int, unsigned char out[], unsigned char in[], pmat_index index[]);
+boolean check_gather_integrity(long, unsigned char out[], unsigned char in[], uint32_t gather[]);
+void init_byte_hashes();
+uint64_t multiset_hash(long, unsigned char bytes[]);
+boolean check_multiset(long, unsigned char out[], unsigned char in[]);
+boolean uniform_bytes(long, unsigned char bytes[]);
+void purge_maps(struct PMAT **);
 void purge_mat(struct PMAT *);
 
 // Utilities ---------------------------------------------------------------------------------------
 int key_sum(char *);
-unsigned char* read_input(cipher *);
-void write_output(cipher *, int);
-char *gen_linked_vals(cipher *, int);
-char *gen_log_base_str(cipher *, double);
+long greatest_common_divisor(long, long);
+char *input_path(cipher *);
+char *output_path(cipher *, int);
+FILE *open_input(cipher *);
+void read_input(cipher *, FILE *);
+void remove_pending_output();
+int open_output(cipher *, int);
+void commit_output(cipher *, int, int);
+void write_chunks(cipher *, long, long);
+char *gen_linked_vals(int, int);
+void gen_log_base_digits(double, double, char *);
+void init_dim_stream(dim_stream *, int, long);
+int map_index_at(dim_stream *, long);
+int variable_dimension(int);
 
 // Instructions ------------------------------------------------------------------------------------
-instruction *create_instruction(int, char *, boolean);
+instruction *create_instruction(int, char *, integrity_mode);
 void set_instructions(cipher *, instruction **, int);
-void read_instructions(cipher *, int);
+void set_new_instructions(cipher *, instruction **, int);
+void read_instructions(cipher *, int, FILE *);
 void print_instruction_at(instruction **, int);
 void print_instructions(instruction **, int);
 void print_last_instruction(instruction **, int);
@@ -18,8 +18,8 @@
 #include <termios.h>
 
 #define BILLION 1000000000L
-#define INIT_OPTIONS "edD:k:o:xmst:hvV"
-#define INSTRUCTION_OPTIONS ":k:D:shrp:P"
+#define INIT_OPTIONS "edrD:k:o:xmsct:g:b:ihvV"
+#define INSTRUCTION_OPTIONS ":k:D:schrp:P"
 
 // Writes elapsed time to a file called cpme_elapsed_time.txt when EXPORT_TIME defined
 // Overwrites file on every execution
@@ -52,14 +52,20 @@ void main_help() {
   printf("By Kyle Won\n\n");
   printf("Usage: cpme [FILE] -e [OPTIONS...]\t\tencrypt mode\n");
   printf("   or: cpme [FILE] -d [OPTIONS...]\t\tdecrypt mode\n");
+  printf("   or: cpme [FILE] -r [OPTIONS...]\t\trekey mode\n");
   printf("\n");
   printf("Arguments:\n");
   printf("   -k\t\tSet encrypt key for first instruction. Expects argument\n");
   printf("   -D\t\tSet matrix dimension for first instruction. If not invoked or 0, defaults to variable-dimension\n");
   printf("   -s\t\tSkip data integrity checks for first instruction. Not recommended\n");
+  printf("   -c\t\tCheck data integrity of first instruction with multiset hashes instead of dot products. Faster, misses misplaced bytes\n");
   printf("   -o\t\tSet output filename. If not invoked, defaults to input filename\n");
   printf("   -m\t\tStart program in instruction input loop (multilevel encryption)\n");
+  printf("   -r\t\tRekey: decrypt with the instructions given, then enter the instructions to encrypt with\n");
   printf("   -t\t\tSet max number of threads to use. If not invoked, defaults to single-threaded\n");
+  printf("   -g\t\tSet number of chunks a thread transforms at a time. If not invoked, picked automatically\n");
+  printf("   -b\t\tSet memory budget in MiB and stream the file through it. If not invoked, reads whole file into memory\n");
+  printf("   -i\t\tTransform the file in place through a memory mapping and rename it to the output name\n");
   printf("   -v\t\tVerbose output level I. Prints instructions as they are added\n");
   printf("   -V\t\tVerbose output level II. Prints debugging information\n");
   printf("   -h\t\tDisplay this help and exit\n\n");
@@ -74,6 +80,7 @@ void instruction_help() {
   printf("   -k\t\tencryption key (omit flag to enter with terminal echoing disabled)\n");
   printf("   -D\t\tpermutation matrix dimension (defaults to variable-dimension if not invoked or set to 0)\n");
   printf("   -s\t\tskip data integrity checks. Not recommended\n");
+  printf("   -c\t\tcheck data integrity with multiset hashes instead of dot products. Faster, misses misplaced bytes\n");
   printf("   -r\t\tdelete last instruction\n");
   printf("   -p\t\tprint single instruction at specified position. Expects integer argument\n");
   printf("   -P\t\tprint all instuctions\n");
@@ -105,7 +112,8 @@ int read_initial_state(initial_state *init, int argc, char **argv) {
   init->dimension = 0;
   init->delete_when_done = false;
   init->multilevel = false;
-  init->integrity_check = true;
+  init->rekey = false;
+  init->integrity_check = CHECK_DOT;
   char error[BUFFER];
   memset(error, '\0', BUFFER);
   int int_arg;
@@ -116,17 +124,25 @@ int read_initial_state(initial_state *init, int argc, char **argv) {
     switch (opt_status) {
       case 'e':
         if(init->encrypt >= 0) {
-          fatal(LOG_OUTPUT, "Invalid usage - cannot set encrypt flag and decrypt flag at the same time.");
+          fatal(LOG_OUTPUT, "Invalid usage - cannot set more than one of the encrypt, decrypt and rekey flags.");
         } else {
           init->encrypt = true;
         }
         break;
       case 'd':
         if(init->encrypt >= 0) {
-          fatal(LOG_OUTPUT, "Invalid usage - cannot set encrypt flag and decrypt flag at the same time.");
+          fatal(LOG_OUTPUT, "Invalid usage - cannot set more than one of the encrypt, decrypt and rekey flags.");
         }
         init->encrypt = false;
         break;
+      case 'r':
+        if(init->encrypt >= 0) {
+          fatal(LOG_OUTPUT, "Invalid usage - cannot set more than one of the encrypt, decrypt and rekey flags.");
+        }
+        // Decrypts with the instructions given first
+        init->encrypt = false;
+        init->rekey = true;
+        break;
       case 'D':
         int_arg = (int)strtol(optarg, &remaining, 10);
         if (int_arg >= 0) {
@@ -148,7 +164,10 @@ int read_initial_state(initial_state *init, int argc, char **argv) {
         init->multilevel = true;
         break;
       case 's':
-        init->integrity_check = false;
+        init->integrity_check = CHECK_NONE;
+        break;
+      case 'c':
+        init->integrity_check = CHECK_MULTISET;
         break;
       case 't':
         int_arg = (int)strtol(optarg, &remaining, 10);
@@ -158,6 +177,25 @@ int read_initial_state(initial_state *init, int argc, char **argv) {
           fatal(LOG_OUTPUT, "Argument for thread option (-t) must be a positive integer.");
         }
         break;
+      case 'g':
+        int_arg = (int)strtol(optarg, &remaining, 10);
+        if (int_arg > 0) {
+          grain_size = int_arg;
+        } else {
+          fatal(LOG_OUTPUT, "Argument for grain size option (-g) must be a positive integer.");
+        }
+        break;
+      case 'b':
+        int_arg = (int)strtol(optarg, &remaining, 10);
+        if (int_arg > 0) {
+          memory_budget = (long)int_arg * 1024 * 1024;
+        } else {
+          fatal(LOG_OUTPUT, "Argument for memory budget option (-b) must be a positive integer.");
+        }
+        break;
+      case 'i':
+        in_place = true;
+        break;
       case 'h':
         // Print main help
         main_help();
@@ -192,7 +230,7 @@ int read_initial_state(initial_state *init, int argc, char **argv) {
 int read_instruction_input(command *com, int argc, char **argv) {
   com->encrypt_key = (char *)calloc(BUFFER, sizeof(char));
   com->dimension = -1;
-  com->integrity_check = true;
+  com->integrity_check = CHECK_DOT;
   com->remove_last = false;
   com->print_all = false;
   com->print_single = -1;
@@ -218,7 +256,10 @@ int read_instruction_input(command *com, int argc, char **argv) {
         strncpy(com->encrypt_key, optarg, strlen(optarg));
         break;
       case 's':
-        com->integrity_check = false;
+        com->integrity_check = CHECK_NONE;
+        break;
+      case 'c':
+        com->integrity_check = CHECK_MULTISET;
         break;
       case 'r':
         com->remove_last = true;
@@ -299,7 +340,7 @@ int instruction_input_loop(instruction **instructions, int num_instructions) {
       }
       // if valid input, create instruction
       if(num_instructions < 10) {
-        if(strlen(com->encrypt_key) > 0 || com->dimension >= 0 || !com->integrity_check) {
+        if(strlen(com->encrypt_key) > 0 || com->dimension >= 0 || com->integrity_check != CHECK_DOT) {
           if(strlen(com->encrypt_key) == 0) {
             get_key(com->encrypt_key);
           }
@@ -357,7 +398,7 @@ int main(int argc, char **argv) {
   // Check if mode specified
   if(init->encrypt < 0) {
     free(init);
-    printf("Invalid usage - must specify encrypt (-e) or decrypt (-d) mode.\n");
+    printf("Invalid usage - must specify encrypt (-e), decrypt (-d) or rekey (-r) mode.\n");
     exit(1);
   }
   // Set number of threads to 1 if not set
@@ -373,15 +414,20 @@ int main(int argc, char **argv) {
   char *just_path = processed[1];
   printf("File name: %s\n", file_name);
   printf("File size: %ld bytes\n", file_len);
-  printf("Mode: %s\n", init->encrypt ? "encrypt" : "decrypt");
+  printf("Mode: %s\n", init->rekey ? "rekey" : init->encrypt ? "encrypt" : "decrypt");
   printf("Threads: %d\n", num_threads);
+  if(in_place) {
+    printf("In place: yes\n");
+  } else if(memory_budget > 0) {
+    printf("Memory budget: %ld MiB\n", memory_budget / (1024 * 1024));
+  }
   printf("\n");
   cipher *ciph = create_cipher(file_name, just_path, file_len, init->output_name);
   instruction **instructions = (instruction **)malloc(sizeof(instruction *) * MAX_INSTRUCTIONS);
   int num_instructions = 0;
   // If first instruction included in program execution statement, add to instruction set,
   // else enter instruction input loop
-  if(strlen(init->encrypt_key) > 0 || init->dimension >= 0 || !init->integrity_check) {
+  if(strlen(init->encrypt_key) > 0 || init->dimension >= 0 || init->integrity_check != CHECK_DOT) {
     // Check if need key input
     if(strlen(init->encrypt_key) == 0) {
       get_key(init->encrypt_key);
@@ -407,7 +453,23 @@ int main(int argc, char **argv) {
     num_instructions = instruction_input_loop(instructions, num_instructions);
   }
   set_instructions(ciph, instructions, num_instructions);
-  if(init->encrypt) {
+  // A rekey encrypts with a second set of instructions once decrypted
+  instruction **new_instructions = NULL;
+  int num_new_instructions = 0;
+  if(init->rekey) {
+    new_instructions = (instruction **)malloc(sizeof(instruction *) * MAX_INSTRUCTIONS);
+    printf("Enter the new instructions to encrypt with\n\n");
+    while(num_new_instructions <= 0) {
+      num_new_instructions = instruction_input_loop(new_instructions, num_new_instructions);
+      if(num_new_instructions <= 0) {
+        printf("Must add at least one instruction\n\n");
+      }
+    }
+    set_new_instructions(ciph, new_instructions, num_new_instructions);
+  }
+  if(init->rekey) {
+    printf("Rekeying...\n");
+  } else if(init->encrypt) {
     printf("Encrypting...\n");
   } else {
     printf("Decrypting...\n");
@@ -419,12 +481,18 @@ int main(int argc, char **argv) {
   clock_gettime(CLOCK_MONOTONIC, &end);
   difference = (long double) (BILLION * (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)) / (double) BILLION;
   clean_instructions(instructions, num_instructions);
+  if(new_instructions) {
+    clean_instructions(new_instructions, num_new_instructions);
+  }
   close_cipher(ciph);
   free_init(init);
   free(processed[0]);
   free(processed[1]);
   free(processed);
   free_instructions(instructions, num_instructions);
+  if(new_instructions) {
+    free_instructions(new_instructions, num_new_instructions);
+  }
   printf("Elapsed time (s): %Lf\n", difference);
 #ifdef EXPORT_TIME
   FILE *time_out = fopen("cpme_elapsed_time.txt", "w");
@@ -0,0 +1,357 @@
+/*
+ * io_queue.c
+ * Copyright (c) Kyle Won, 2021
+ * Asynchronous positioned file I/O used to overlap streaming reads and writes with transformations.
+ */
+
+// Define default source for syscall and clock
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "io_queue.h"
+#ifdef CPME_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// Statistics --------------------------------------------------------------------------------------
+
+/*
+ * Counts a request of the given direction as in flight.
+ */
+static void start_stats(io_stats *stats) {
+  if(stats->in_flight == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &stats->busy_since);
+  }
+  stats->in_flight += 1;
+}
+
+/*
+ * Counts a completed request of the given direction and length.
+ */
+static void finish_stats(io_stats *stats, long length) {
+  stats->in_flight -= 1;
+  stats->bytes += length;
+  if(stats->in_flight == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats->busy_seconds += (double)(now.tv_sec - stats->busy_since.tv_sec)
+                           + (double)(now.tv_nsec - stats->busy_since.tv_nsec) / 1000000000.0;
+  }
+}
+
+// io_uring backend --------------------------------------------------------------------------------
+
+#ifdef CPME_IO_URING
+/*
+ * Sets up an io_uring of the queue's depth and maps its rings. Returns false if the kernel does not
+ * allow it.
+ */
+static boolean uring_setup(io_queue *q) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, (unsigned)q->depth, &params);
+  if(fd < 0) {
+    return false;
+  }
+  q->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  q->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  boolean single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if(single_mmap) {
+    // Both rings share one mapping
+    q->sq_ring_len = q->sq_ring_len > q->cq_ring_len ? q->sq_ring_len : q->cq_ring_len;
+    q->cq_ring_len = q->sq_ring_len;
+  }
+  q->sq_ring = mmap(NULL, q->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+  if(q->sq_ring == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  q->cq_ring = single_mmap ? q->sq_ring
+                           : mmap(NULL, q->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+  q->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+  if(q->cq_ring == MAP_FAILED || q->sqes == MAP_FAILED) {
+    // Unmap what was mapped, the queue falls back to blocking I/O
+    if(q->sqes != MAP_FAILED) {
+      munmap(q->sqes, q->sqes_len);
+    }
+    if(!single_mmap && q->cq_ring != MAP_FAILED) {
+      munmap(q->cq_ring, q->cq_ring_len);
+    }
+    munmap(q->sq_ring, q->sq_ring_len);
+    close(fd);
+    return false;
+  }
+  unsigned char *sq = (unsigned char *)q->sq_ring;
+  unsigned char *cq = (unsigned char *)q->cq_ring;
+  q->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  q->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  q->sq_array = (unsigned *)(sq + params.sq_off.array);
+  q->cq_head = (unsigned *)(cq + params.cq_off.head);
+  q->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  q->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  q->cqes = (void *)(cq + params.cq_off.cqes);
+  q->ring_fd = fd;
+  return true;
+}
+
+/*
+ * Submits the untransferred remainder of the request in the given slot to the ring.
+ */
+static void uring_push(io_queue *q, int slot) {
+  io_request *r = &q->requests[slot];
+  // Only this thread writes the submission tail
+  unsigned tail = *q->sq_tail;
+  unsigned index = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &((struct io_uring_sqe *)q->sqes)[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->iov.iov_base = r->buf + r->done;
+  r->iov.iov_len = (size_t)(r->length - r->done);
+  sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = r->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&r->iov;
+  sqe->len = 1;
+  sqe->off = (uint64_t)(r->offset + r->done);
+  sqe->user_data = (uint64_t)slot;
+  q->sq_array[index] = index;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  while(syscall(__NR_io_uring_enter, q->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+    if(errno != EINTR) {
+      fatal(LOG_OUTPUT, "Error submitting I/O in uring_push(), io_queue.c.");
+    }
+  }
+}
+
+/*
+ * Waits for the next completion on the ring. Returns the slot of its request and stores its result.
+ */
+static int uring_wait(io_queue *q, long *result) {
+  while(true) {
+    unsigned head = *q->cq_head;
+    unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    if(head != tail) {
+      struct io_uring_cqe *cqe = &((struct io_uring_cqe *)q->cqes)[head & *q->cq_mask];
+      int slot = (int)cqe->user_data;
+      *result = cqe->res;
+      __atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+      return slot;
+    }
+    if(syscall(__NR_io_uring_enter, q->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+      fatal(LOG_OUTPUT, "Error waiting for I/O in uring_wait(), io_queue.c.");
+    }
+  }
+}
+#endif
+
+// Thread backend ----------------------------------------------------------------------------------
+
+/*
+ * I/O thread loop. Runs pending requests to completion with pread and pwrite in submission order,
+ * until the queue shuts down. A request which fails is completed with fewer bytes than its length.
+ */
+static void *io_thread_func(void *args) {
+  io_queue *q = (io_queue *)args;
+  while(true) {
+    pthread_mutex_lock(&q->lock);
+    while(q->pending_head < 0 && !q->shutdown) {
+      pthread_cond_wait(&q->pending_cond, &q->lock);
+    }
+    int slot = q->pending_head;
+    if(slot < 0) {
+      pthread_mutex_unlock(&q->lock);
+      return NULL;
+    }
+    q->pending_head = q->requests[slot].next;
+    if(q->pending_head < 0) {
+      q->pending_tail = -1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    io_request *r = &q->requests[slot];
+    while(r->done < r->length) {
+      ssize_t n = r->write ? pwrite(r->fd, r->buf + r->done, (size_t)(r->length - r->done), (off_t)(r->offset + r->done))
+                           : pread(r->fd, r->buf + r->done, (size_t)(r->length - r->done), (off_t)(r->offset + r->done));
+      if(n < 0 && errno == EINTR) {
+        continue;
+      }
+      if(n <= 0) {
+        break;
+      }
+      r->done += n;
+    }
+    pthread_mutex_lock(&q->lock);
+    r->next = q->completed_head;
+    q->completed_head = slot;
+    pthread_cond_signal(&q->completed_cond);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+// Constructors and Destructors --------------------------------------------------------------------
+
+/*
+ * Creates a queue allowing the given number of requests in flight at a time.
+ */
+io_queue *create_io_queue(int depth) {
+  io_queue *q = (io_queue *)calloc(1, sizeof(io_queue));
+  if(!q) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_io_queue(), io_queue.c."); exit(-1);
+  }
+  q->depth = depth > 0 ? depth : 1;
+  q->requests = (io_request *)calloc((size_t)q->depth, sizeof(io_request));
+  q->free_slots = (int *)malloc(sizeof(int) * q->depth);
+  if(!q->requests || !q->free_slots) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_io_queue(), io_queue.c."); exit(-1);
+  }
+  for(int i = 0; i < q->depth; i++) {
+    q->free_slots[i] = i;
+  }
+  q->num_free = q->depth;
+  q->uring = false;
+#ifdef CPME_IO_URING
+  q->uring = uring_setup(q);
+#endif
+  if(!q->uring) {
+    // Fall back to a thread running blocking positioned I/O
+    q->pending_head = -1;
+    q->pending_tail = -1;
+    q->completed_head = -1;
+    q->shutdown = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->pending_cond, NULL);
+    pthread_cond_init(&q->completed_cond, NULL);
+    if(pthread_create(&q->thread, NULL, io_thread_func, (void *)q) != 0) {
+      fatal(LOG_OUTPUT, "Thread creation error in create_io_queue(), io_queue.c."); exit(-1);
+    }
+  }
+  return q;
+}
+
+/*
+ * Releases the queue's backend and frees it. Every submitted request must have been reaped.
+ */
+void close_io_queue(io_queue *q) {
+  if(q->uring) {
+#ifdef CPME_IO_URING
+    munmap(q->sqes, q->sqes_len);
+    if(q->cq_ring != q->sq_ring) {
+      munmap(q->cq_ring, q->cq_ring_len);
+    }
+    munmap(q->sq_ring, q->sq_ring_len);
+    close(q->ring_fd);
+#endif
+  } else {
+    pthread_mutex_lock(&q->lock);
+    q->shutdown = true;
+    pthread_cond_signal(&q->pending_cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->pending_cond);
+    pthread_cond_destroy(&q->completed_cond);
+  }
+  free(q->requests);
+  free(q->free_slots);
+  free(q);
+}
+
+// Requests ----------------------------------------------------------------------------------------
+
+/*
+ * Starts reading length bytes of the given file at the given offset into buf, or writing them from
+ * buf if write is set. The tag is returned by reap_io() once the whole transfer is done. At most
+ * depth requests may be in flight.
+ */
+void submit_io(io_queue *q, int fd, unsigned char *buf, long offset, long length, boolean write, void *tag) {
+  if(q->num_free == 0) {
+    fatal(LOG_OUTPUT, "I/O queue full in submit_io(), io_queue.c.");
+  }
+  q->num_free -= 1;
+  int slot = q->free_slots[q->num_free];
+  io_request *r = &q->requests[slot];
+  r->fd = fd;
+  r->buf = buf;
+  r->offset = offset;
+  r->length = length;
+  r->done = 0;
+  r->write = write;
+  r->tag = tag;
+  r->next = -1;
+  start_stats(write ? &q->write_stats : &q->read_stats);
+  if(q->uring) {
+#ifdef CPME_IO_URING
+    uring_push(q, slot);
+#endif
+    return;
+  }
+  pthread_mutex_lock(&q->lock);
+  if(q->pending_tail >= 0) {
+    q->requests[q->pending_tail].next = slot;
+  } else {
+    q->pending_head = slot;
+  }
+  q->pending_tail = slot;
+  pthread_cond_signal(&q->pending_cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Blocks until a submitted request has been fully transferred and returns its tag.
+ */
+void *reap_io(io_queue *q) {
+  int slot = 0;
+  io_request *r;
+  if(q->uring) {
+#ifdef CPME_IO_URING
+    while(true) {
+      long result;
+      slot = uring_wait(q, &result);
+      r = &q->requests[slot];
+      if(result <= 0) {
+        fatal(LOG_OUTPUT, "Error transferring file data in reap_io(), io_queue.c.");
+      }
+      r->done += result;
+      if(r->done == r->length) {
+        break;
+      }
+      // Short transfer, submit the rest
+      uring_push(q, slot);
+    }
+#endif
+  } else {
+    pthread_mutex_lock(&q->lock);
+    while(q->completed_head < 0) {
+      pthread_cond_wait(&q->completed_cond, &q->lock);
+    }
+    slot = q->completed_head;
+    q->completed_head = q->requests[slot].next;
+    pthread_mutex_unlock(&q->lock);
+  }
+  r = &q->requests[slot];
+  if(r->done != r->length) {
+    fatal(LOG_OUTPUT, "Error transferring file data in reap_io(), io_queue.c.");
+  }
+  finish_stats(r->write ? &q->write_stats : &q->read_stats, r->length);
+  q->free_slots[q->num_free] = slot;
+  q->num_free += 1;
+  return r->tag;
+}
+
+/*
+ * Prints the backend used and the bandwidth achieved while reads and writes were in flight.
+ */
+void print_io_stats(io_queue *q) {
+  io_stats *stats[2] = {&q->read_stats, &q->write_stats};
+  char *names[2] = {"Read", "Wrote"};
+  printf("I/O backend: %s\n", q->uring ? "io_uring" : "pread/pwrite thread");
+  for(int i = 0; i < 2; i++) {
+    double mb = (double)stats[i]->bytes / (1024 * 1024);
+    double seconds = stats[i]->busy_seconds;
+    printf("%s %.2lf MiB at %.2lf MiB/s\n", names[i], mb, seconds > 0 ? mb / seconds : 0.0);
+  }
+}
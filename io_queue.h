@@ -0,0 +1,97 @@
+/*
+ * io_queue.h
+ * Copyright (c) Kyle Won, 2021
+ * CPME asynchronous positioned file I/O header file.
+ */
+
+#ifndef CPME_IO_QUEUE_H
+#define CPME_IO_QUEUE_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "util.h"
+
+// Build the io_uring backend when the kernel headers provide it, unless CPME_NO_IO_URING is defined
+#if defined(__linux__) && defined(__has_include) && !defined(CPME_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define CPME_IO_URING
+#endif
+#endif
+
+/*
+ * Positioned read or write of a buffer. Stays in its slot of the queue until it has fully completed.
+ */
+typedef struct io_request {
+  int fd;
+  unsigned char *buf;
+  long offset;
+  long length;
+  // Bytes transferred so far
+  long done;
+  boolean write;
+  void *tag;
+  struct iovec iov;
+  // Next request in the pending or completed list of the thread backend, -1 if last
+  int next;
+} io_request;
+
+/*
+ * Direction of transfer. Tracks the time during which at least one request was in flight.
+ */
+typedef struct io_stats {
+  long bytes;
+  int in_flight;
+  struct timespec busy_since;
+  double busy_seconds;
+} io_stats;
+
+/*
+ * Queue of up to depth positioned reads and writes in flight at a time. Requests complete in any
+ * order. Uses io_uring if the kernel supports it, otherwise a thread running pread and pwrite.
+ */
+typedef struct io_queue {
+  int depth;
+  io_request *requests;
+  // Slots not holding a request, used as a stack
+  int *free_slots;
+  int num_free;
+  boolean uring;
+  // io_uring backend, rings shared with the kernel
+  int ring_fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_len;
+  size_t cq_ring_len;
+  void *sqes;
+  size_t sqes_len;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  void *cqes;
+  // Thread backend
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t pending_cond;
+  pthread_cond_t completed_cond;
+  int pending_head;
+  int pending_tail;
+  int completed_head;
+  boolean shutdown;
+  io_stats read_stats;
+  io_stats write_stats;
+} io_queue;
+
+// Constructors and Destructors --------------------------------------------------------------------
+io_queue *create_io_queue(int);
+void close_io_queue(io_queue *);
+
+// Requests ----------------------------------------------------------------------------------------
+void submit_io(io_queue *, int, unsigned char *, long, long, boolean, void *);
+void *reap_io(io_queue *);
+void print_io_stats(io_queue *);
+
+#endif //CPME_IO_QUEUE_H
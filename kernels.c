@@ -0,0 +1,160 @@
+/*
+ * kernels.c
+ * Copyright (c) Kyle Won, 2021
+ * CPME permutation kernels. Every kernel produces the same output, the fastest one the CPU supports
+ * is chosen at startup.
+ */
+
+#include "kernels.h"
+#include <stdio.h>
+#ifdef CPME_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static boolean scalar_supported() {
+  return true;
+}
+
+#ifdef CPME_X86_KERNELS
+static boolean sse42_supported() {
+  return __builtin_cpu_supports("sse4.2") ? true : false;
+}
+
+static boolean avx2_supported() {
+  return __builtin_cpu_supports("avx2") ? true : false;
+}
+
+static boolean avx512_supported() {
+  return __builtin_cpu_supports("avx512f") ? true : false;
+}
+#endif
+
+permute_kernel permute_kernels[] = {
+#ifdef CPME_X86_KERNELS
+  {"AVX-512", permute_avx512, avx512_supported},
+  {"AVX2", permute_avx2, avx2_supported},
+  {"SSE4.2", permute_sse42, sse42_supported},
+#endif
+  {"scalar", permute_scalar, scalar_supported}
+};
+int num_permute_kernels = sizeof(permute_kernels) / sizeof(permute_kernel);
+permute_kernel *active_kernel = &permute_kernels[sizeof(permute_kernels) / sizeof(permute_kernel) - 1];
+
+// Dispatch -----------------------------------------------------------------------------------------
+
+/*
+ * Chooses the kernel used for new matrices. Call before generating any matrix.
+ */
+void init_kernels() {
+  active_kernel = select_kernel();
+  if(verbose_lvl_2) {
+    printf("Permutation kernel: %s\n", active_kernel->name);
+  }
+}
+
+/*
+ * Returns the fastest kernel the running CPU supports.
+ */
+permute_kernel *select_kernel() {
+#ifdef CPME_X86_KERNELS
+  __builtin_cpu_init();
+#endif
+  for(int i = 0; i < num_permute_kernels; i++) {
+    if(permute_kernels[i].supported()) {
+      return &permute_kernels[i];
+    }
+  }
+  return &permute_kernels[num_permute_kernels - 1];
+}
+
+// Kernels -----------------------------------------------------------------------------------------
+
+/*
+ * Portable kernel, one byte at a time.
+ */
+void permute_scalar(int dimension, unsigned char out[], unsigned char in[], pmat_index index[]) {
+  for(int i = 0; i < dimension; i++) {
+    out[i] = in[index[i]];
+  }
+}
+
+#ifdef CPME_X86_KERNELS
+/*
+ * Gathers 16 bytes at a time into a vector register, stored with a single write.
+ */
+__attribute__((target("sse4.2")))
+void permute_sse42(int dimension, unsigned char out[], unsigned char in[], pmat_index index[]) {
+  int i = 0;
+  for(; i + 16 <= dimension; i += 16) {
+    pmat_index *idx = index + i;
+    __m128i v = _mm_cvtsi32_si128(in[idx[0]]);
+    v = _mm_insert_epi8(v, in[idx[1]], 1);
+    v = _mm_insert_epi8(v, in[idx[2]], 2);
+    v = _mm_insert_epi8(v, in[idx[3]], 3);
+    v = _mm_insert_epi8(v, in[idx[4]], 4);
+    v = _mm_insert_epi8(v, in[idx[5]], 5);
+    v = _mm_insert_epi8(v, in[idx[6]], 6);
+    v = _mm_insert_epi8(v, in[idx[7]], 7);
+    v = _mm_insert_epi8(v, in[idx[8]], 8);
+    v = _mm_insert_epi8(v, in[idx[9]], 9);
+    v = _mm_insert_epi8(v, in[idx[10]], 10);
+    v = _mm_insert_epi8(v, in[idx[11]], 11);
+    v = _mm_insert_epi8(v, in[idx[12]], 12);
+    v = _mm_insert_epi8(v, in[idx[13]], 13);
+    v = _mm_insert_epi8(v, in[idx[14]], 14);
+    v = _mm_insert_epi8(v, in[idx[15]], 15);
+    _mm_storeu_si128((__m128i *)(out + i), v);
+  }
+  for(; i < dimension; i++) {
+    out[i] = in[index[i]];
+  }
+}
+
+/*
+ * Gathers the 32 bit words starting at 32 indexes with four 8 lane gathers, then packs their low
+ * bytes. Reads up to 3 bytes past the input.
+ */
+__attribute__((target("avx2")))
+void permute_avx2(int dimension, unsigned char out[], unsigned char in[], pmat_index index[]) {
+  const __m256i low_byte = _mm256_set1_epi32(0xFF);
+  // Packing interleaves the 128 bit lanes, this restores the order of the words
+  const __m256i lane_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  const int *base = (const int *)in;
+  int i = 0;
+  for(; i + 32 <= dimension; i += 32) {
+    __m256i i0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(index + i)));
+    __m256i i1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(index + i + 8)));
+    __m256i i2 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(index + i + 16)));
+    __m256i i3 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(index + i + 24)));
+    __m256i g0 = _mm256_and_si256(_mm256_i32gather_epi32(base, i0, 1), low_byte);
+    __m256i g1 = _mm256_and_si256(_mm256_i32gather_epi32(base, i1, 1), low_byte);
+    __m256i g2 = _mm256_and_si256(_mm256_i32gather_epi32(base, i2, 1), low_byte);
+    __m256i g3 = _mm256_and_si256(_mm256_i32gather_epi32(base, i3, 1), low_byte);
+    __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(g0, g1), _mm256_packus_epi32(g2, g3));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(packed, lane_order));
+  }
+  for(; i < dimension; i++) {
+    out[i] = in[index[i]];
+  }
+}
+
+/*
+ * Gathers the 32 bit words starting at 32 indexes with two 16 lane gathers, then truncates them to
+ * their low bytes. Reads up to 3 bytes past the input.
+ */
+__attribute__((target("avx512f")))
+void permute_avx512(int dimension, unsigned char out[], unsigned char in[], pmat_index index[]) {
+  int i = 0;
+  for(; i + 32 <= dimension; i += 32) {
+    __m512i i0 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(index + i)));
+    __m512i i1 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(index + i + 16)));
+    __m512i g0 = _mm512_i32gather_epi32(i0, (const void *)in, 1);
+    __m512i g1 = _mm512_i32gather_epi32(i1, (const void *)in, 1);
+    _mm_storeu_si128((__m128i *)(out + i), _mm512_cvtepi32_epi8(g0));
+    _mm_storeu_si128((__m128i *)(out + i + 16), _mm512_cvtepi32_epi8(g1));
+  }
+  for(; i < dimension; i++) {
+    out[i] = in[index[i]];
+  }
+}
+#endif
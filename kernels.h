@@ -0,0 +1,48 @@
+/*
+ * kernels.h
+ * Copyright (c) Kyle Won, 2021
+ * CPME permutation kernel header file.
+ */
+
+#ifndef CPME_KERNELS_H
+#define CPME_KERNELS_H
+
+#include "cpme.h"
+
+// Build the x86 SIMD kernels when the compiler can target them per function. They load 16 bit indexes
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && MAX_DIMENSION <= 65536
+#define CPME_X86_KERNELS
+#endif
+
+// Bytes past the end of its input a kernel may read. Kernel inputs must be allocated this much longer
+#define KERNEL_PADDING 64
+
+/*
+ * Implementation of the permutation of a chunk for one instruction set.
+ */
+typedef struct permute_kernel {
+  const char *name;
+  permute_func permute;
+  // Returns whether the running CPU supports the kernel's instructions
+  boolean (*supported)();
+} permute_kernel;
+
+// Every kernel built, fastest first, the last is the portable scalar kernel
+extern permute_kernel permute_kernels[];
+extern int num_permute_kernels;
+// Kernel used for new matrices, chosen by init_kernels()
+extern permute_kernel *active_kernel;
+
+// Dispatch -----------------------------------------------------------------------------------------
+void init_kernels();
+permute_kernel *select_kernel();
+
+// Kernels -----------------------------------------------------------------------------------------
+void permute_scalar(int, unsigned char out[], unsigned char in[], pmat_index index[]);
+#ifdef CPME_X86_KERNELS
+void permute_sse42(int, unsigned char out[], unsigned char in[], pmat_index index[]);
+void permute_avx2(int, unsigned char out[], unsigned char in[], pmat_index index[]);
+void permute_avx512(int, unsigned char out[], unsigned char in[], pmat_index index[]);
+#endif
+
+#endif //CPME_KERNELS_H
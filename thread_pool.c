@@ -0,0 +1,280 @@
+/*
+ * thread_pool.c
+ * Copyright (c) Kyle Won, 2021
+ * Persistent worker thread pool shared by matrix generation and linear transformations.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "thread_pool.h"
+
+// Workers -----------------------------------------------------------------------------------------
+
+/*
+ * Worker loop. Runs queued tasks in submission order until the pool shuts down and the queue
+ * is empty.
+ */
+static void *worker_func(void *args) {
+  thread_pool *pool = (thread_pool *)args;
+  while(true) {
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->head && !pool->shutdown) {
+      pthread_cond_wait(&pool->available, &pool->lock);
+    }
+    task *t = pool->head;
+    if(!t) {
+      // Shutting down and nothing left to run
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    pool->head = t->next;
+    if(!pool->head) {
+      pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    t->func(t->args);
+    task_group *group = t->group;
+    free(t);
+    if(group) {
+      pthread_mutex_lock(&group->lock);
+      group->pending -= 1;
+      if(group->pending == 0) {
+        pthread_cond_broadcast(&group->done);
+      }
+      pthread_mutex_unlock(&group->lock);
+    }
+  }
+}
+
+// Constructors and Destructors --------------------------------------------------------------------
+
+/*
+ * Creates a pool of the given number of worker threads.
+ */
+thread_pool *create_thread_pool(int num_workers) {
+  thread_pool *pool = (thread_pool *)malloc(sizeof(thread_pool));
+  if(!pool) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_thread_pool(), thread_pool.c."); exit(-1);
+  }
+  num_workers = num_workers > 0 ? num_workers : 1;
+  pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+  if(!pool->threads) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_thread_pool(), thread_pool.c."); exit(-1);
+  }
+  pool->num_threads = num_workers;
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->shutdown = false;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  for(int i = 0; i < num_workers; i++) {
+    if(pthread_create(&pool->threads[i], NULL, worker_func, (void *)pool) != 0) {
+      fatal(LOG_OUTPUT, "Thread creation error in create_thread_pool(), thread_pool.c."); exit(-1);
+    }
+  }
+  return pool;
+}
+
+/*
+ * Runs any remaining queued tasks, joins the workers and frees the pool.
+ */
+void close_thread_pool(thread_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->available);
+  pthread_mutex_unlock(&pool->lock);
+  for(int i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->available);
+  free(pool->threads);
+  free(pool);
+}
+
+/*
+ * Creates an empty completion handle.
+ */
+task_group *create_task_group() {
+  task_group *group = (task_group *)malloc(sizeof(task_group));
+  if(!group) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in create_task_group(), thread_pool.c."); exit(-1);
+  }
+  group->pending = 0;
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->done, NULL);
+  return group;
+}
+
+/*
+ * Frees given completion handle. Make sure to call wait_task_group() first.
+ */
+void free_task_group(task_group *group) {
+  pthread_mutex_destroy(&group->lock);
+  pthread_cond_destroy(&group->done);
+  free(group);
+}
+
+// Tasks -------------------------------------------------------------------------------------------
+
+/*
+ * Queues the given function to run on a worker thread. The task counts towards the given group,
+ * if any, until it returns.
+ */
+void submit_task(thread_pool *pool, task_group *group, task_func func, void *args) {
+  task *t = (task *)malloc(sizeof(task));
+  if(!t) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in submit_task(), thread_pool.c."); exit(-1);
+  }
+  t->func = func;
+  t->args = args;
+  t->group = group;
+  t->next = NULL;
+  if(group) {
+    pthread_mutex_lock(&group->lock);
+    group->pending += 1;
+    pthread_mutex_unlock(&group->lock);
+  }
+  pthread_mutex_lock(&pool->lock);
+  if(pool->tail) {
+    pool->tail->next = t;
+  } else {
+    pool->head = t;
+  }
+  pool->tail = t;
+  pthread_cond_signal(&pool->available);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Blocks until every task submitted under the given group has finished.
+ */
+void wait_task_group(task_group *group) {
+  pthread_mutex_lock(&group->lock);
+  while(group->pending > 0) {
+    pthread_cond_wait(&group->done, &group->lock);
+  }
+  pthread_mutex_unlock(&group->lock);
+}
+
+// Work stealing -----------------------------------------------------------------------------------
+
+/*
+ * Takes up to grain items from the front of the worker's own range. Returns false if it is empty.
+ */
+static boolean take_own(steal_loop *loop, int worker, long *start, long *end) {
+  steal_range *own = &loop->ranges[worker];
+  pthread_mutex_lock(&own->lock);
+  *start = own->next;
+  *end = own->next + loop->grain < own->end ? own->next + loop->grain : own->end;
+  own->next = *end;
+  pthread_mutex_unlock(&own->lock);
+  return *start < *end;
+}
+
+/*
+ * Moves the back half of the largest remaining range to the given worker's range. Returns false if
+ * every range is empty.
+ */
+static boolean steal(steal_loop *loop, int worker) {
+  while(true) {
+    int victim = -1;
+    long most = 0;
+    for(int i = 0; i < loop->num_workers; i++) {
+      steal_range *r = &loop->ranges[i];
+      pthread_mutex_lock(&r->lock);
+      long remaining = r->end - r->next;
+      pthread_mutex_unlock(&r->lock);
+      if(remaining > most) {
+        most = remaining;
+        victim = i;
+      }
+    }
+    if(victim < 0) {
+      return false;
+    }
+    steal_range *r = &loop->ranges[victim];
+    pthread_mutex_lock(&r->lock);
+    long remaining = r->end - r->next;
+    if(remaining <= 0) {
+      // Emptied since the scan, look again
+      pthread_mutex_unlock(&r->lock);
+      continue;
+    }
+    long split = r->end - (remaining + 1) / 2;
+    long end = r->end;
+    r->end = split;
+    pthread_mutex_unlock(&r->lock);
+    steal_range *own = &loop->ranges[worker];
+    pthread_mutex_lock(&own->lock);
+    own->next = split;
+    own->end = end;
+    pthread_mutex_unlock(&own->lock);
+    return true;
+  }
+}
+
+/*
+ * Worker of a work stealing loop. Runs until no range has items left.
+ */
+static void *steal_worker_func(void *args) {
+  steal_loop *loop = (steal_loop *)args;
+  pthread_mutex_lock(&loop->lock);
+  int worker = loop->next_worker;
+  loop->next_worker += 1;
+  pthread_mutex_unlock(&loop->lock);
+  long start;
+  long end;
+  do {
+    while(take_own(loop, worker, &start, &end)) {
+      loop->func(loop->args, start, end, worker);
+    }
+  } while(steal(loop, worker));
+  return NULL;
+}
+
+/*
+ * Starts processing items 0 to num_items - 1 on every worker of the pool, grain items at a time, and
+ * returns without waiting. Items start evenly split between workers in contiguous ranges. The
+ * function is also passed the number, below the pool's thread count, of the worker running it.
+ */
+steal_loop *start_steal_loop(thread_pool *pool, long num_items, long grain, range_func func, void *args) {
+  steal_loop *loop = (steal_loop *)malloc(sizeof(steal_loop));
+  if(!loop) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in start_steal_loop(), thread_pool.c."); exit(-1);
+  }
+  loop->num_workers = pool->num_threads;
+  loop->grain = grain > 0 ? grain : 1;
+  loop->func = func;
+  loop->args = args;
+  loop->next_worker = 0;
+  pthread_mutex_init(&loop->lock, NULL);
+  loop->ranges = (steal_range *)malloc(sizeof(steal_range) * loop->num_workers);
+  if(!loop->ranges) {
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in start_steal_loop(), thread_pool.c."); exit(-1);
+  }
+  for(int i = 0; i < loop->num_workers; i++) {
+    pthread_mutex_init(&loop->ranges[i].lock, NULL);
+    loop->ranges[i].next = num_items * i / loop->num_workers;
+    loop->ranges[i].end = num_items * (i + 1) / loop->num_workers;
+  }
+  loop->workers = create_task_group();
+  for(int i = 0; i < loop->num_workers; i++) {
+    submit_task(pool, loop->workers, steal_worker_func, (void *)loop);
+  }
+  return loop;
+}
+
+/*
+ * Waits until every item of the given loop is done and frees it.
+ */
+void finish_steal_loop(steal_loop *loop) {
+  wait_task_group(loop->workers);
+  free_task_group(loop->workers);
+  for(int i = 0; i < loop->num_workers; i++) {
+    pthread_mutex_destroy(&loop->ranges[i].lock);
+  }
+  pthread_mutex_destroy(&loop->lock);
+  free(loop->ranges);
+  free(loop);
+}
@@ -0,0 +1,89 @@
+/*
+ * thread_pool.h
+ * Copyright (c) Kyle Won, 2021
+ * CPME persistent worker thread pool header file.
+ */
+
+#ifndef CPME_THREAD_POOL_H
+#define CPME_THREAD_POOL_H
+
+#include <pthread.h>
+#include "util.h"
+
+typedef void *(*task_func)(void *);
+// Processes the items from start (inclusive) to end (exclusive) on the given worker
+typedef void (*range_func)(void *, long, long, int);
+
+/*
+ * Completion handle for a set of tasks. Counts the submitted tasks which have not yet finished.
+ */
+typedef struct task_group {
+  int pending;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} task_group;
+
+/*
+ * Queued unit of work.
+ */
+typedef struct task {
+  task_func func;
+  void *args;
+  task_group *group;
+  struct task *next;
+} task;
+
+/*
+ * Fixed set of worker threads which run queued tasks in submission order.
+ */
+typedef struct thread_pool {
+  pthread_t *threads;
+  int num_threads;
+  task *head;
+  task *tail;
+  boolean shutdown;
+  pthread_mutex_t lock;
+  // Signals workers when a task is queued or the pool is shutting down
+  pthread_cond_t available;
+} thread_pool;
+
+/*
+ * Range of items owned by one worker of a work stealing loop.
+ */
+typedef struct steal_range {
+  pthread_mutex_t lock;
+  long next;
+  long end;
+} steal_range;
+
+/*
+ * Work stealing loop over a range of items. Every worker owns a contiguous range and takes grain
+ * items at a time from its front. Idle workers steal the back half of the largest range left.
+ */
+typedef struct steal_loop {
+  steal_range *ranges;
+  int num_workers;
+  long grain;
+  range_func func;
+  void *args;
+  // Hands out worker numbers
+  int next_worker;
+  pthread_mutex_t lock;
+  task_group *workers;
+} steal_loop;
+
+// Constructors and Destructors --------------------------------------------------------------------
+thread_pool *create_thread_pool(int);
+void close_thread_pool(thread_pool *);
+task_group *create_task_group();
+void free_task_group(task_group *);
+
+// Tasks -------------------------------------------------------------------------------------------
+void submit_task(thread_pool *, task_group *, task_func, void *);
+void wait_task_group(task_group *);
+
+// Work stealing -----------------------------------------------------------------------------------
+steal_loop *start_steal_loop(thread_pool *, long, long, range_func, void *);
+void finish_steal_loop(steal_loop *);
+
+#endif //CPME_THREAD_POOL_H
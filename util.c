@@ -11,6 +11,14 @@
 #include <unistd.h>
 #include "util.h"
 
+// Globals -----------------------------------------------------------------------------------------
+int num_threads;
+long grain_size;
+long memory_budget;
+boolean in_place;
+boolean verbose_lvl_1;
+boolean verbose_lvl_2;
+
 // Main function helpers ---------------------------------------------------------------------------
 
 /*
@@ -54,70 +62,63 @@ void fatal(char *log_path, char *message) {
   exit(-1);
 }
 
-// Linked List -------------------------------------------------------------------------------------
+// Order statistic tree ----------------------------------------------------------------------------
 
 /*
- * Allocates the trash to be 2 time given size of linked list to accommodate
- * for the two "row" and "column" lists.
+ * Allocates an order statistic tree in which every index from 0 to size - 1 is present.
  */
-node **init_ll_trash(int ll_size) {
-  node **t = (node **)malloc(sizeof(node *) * (ll_size * 2));
+order_tree *init_order_tree(int size) {
+  order_tree *t = (order_tree *)malloc(sizeof(order_tree) + sizeof(int)*(size + 1));
   if(!t) {
-    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_ll_trash, util.c."); exit(-1);
+    fatal(LOG_OUTPUT, "Dynamic memory allocation error in init_order_tree, util.c."); exit(-1);
   }
-  return t;
-}
-
-/*
- * Recursively creates new nodes until the correct length has been reached.
- */
-node *build_ll(node *last, int dimension) {
-  node *cur = (node *)malloc(sizeof(*cur));
-  cur->last = last;
-  cur->number = last->number + 1;
-  if(cur->number == dimension - 1) {
-    cur->next = NULL;
-  } else {
-    cur->next = build_ll(cur, dimension);
+  t->size = size;
+  t->top_bit = 1;
+  while(t->top_bit <= size / 2) {
+    t->top_bit <<= 1;
   }
-  return cur;
-}
-
-/*
- * Removes the given node from the linked list of the given head node.
- */
-void remove_node(node **head, node *n) {
-  if(!n) {
-    return;
+  t->tree[0] = 0;
+  //every index present, so each node counts the full range it covers
+  for(int i = 1; i <= size; i++) {
+    t->tree[i] = i & -i;
   }
-  if(!n->last && n->next) { //first node in list
-    *head = (*head)->next;
-    (*head)->last = NULL;
-  } else if(!n->next && n->last) { //last node in list
-    n->last->next = NULL;
-  } else if(n->next && n->last){ //middle node in list
-    n->last->next = n->next;
-    n->next->last = n->last;
-  } // Else, last node in list
+  return t;
 }
 
 /*
- * Frees linked list nodes in trash array.
+ * Fetches the index of the given rank (0 = smallest) among the indexes still present in the tree
+ * and removes it. Equivalent to walking a sorted linked list of the remaining indexes rank nodes
+ * from the head and unlinking the node reached.
  */
-void empty_trash(node **trash, int trash_index) {
-  for(int i = 0; i < trash_index; i++) {
-    if(trash[i]) {
-      free(trash[i]);
-      trash[i] = NULL;
+int pull_index(order_tree *t, int rank) {
+  if(rank < 0) {
+    fatal(LOG_OUTPUT, "Order statistic tree rank out of bounds in pull_index, util.c."); exit(-1);
+  }
+  //descend to the last position whose prefix count is <= rank
+  int pos = 0;
+  int remaining = rank;
+  for(int step = t->top_bit; step > 0; step >>= 1) {
+    int next = pos + step;
+    if(next <= t->size && t->tree[next] <= remaining) {
+      pos = next;
+      remaining -= t->tree[next];
     }
   }
+  if(pos >= t->size) {
+    fatal(LOG_OUTPUT, "Order statistic tree rank out of bounds in pull_index, util.c."); exit(-1);
+  }
+  //pos is 0-based index of the pulled value, pos + 1 is its 1-based tree position
+  for(int i = pos + 1; i <= t->size; i += i & -i) {
+    t->tree[i] -= 1;
+  }
+  return pos;
 }
 
 /*
- * Frees trash array. Make sure to call empty_trash() first.
+ * Frees given order statistic tree.
  */
-void free_ll_trash(node **trash) {
-  free(trash);
+void free_order_tree(order_tree *t) {
+  free(t);
 }
 
 // FontBlanc_C helpers -----------------------------------------------------------------------------
@@ -10,12 +10,22 @@
 #define LOG_OUTPUT "cpme_log.txt"
 #define BUFFER 256
 typedef enum { false, true } boolean;
+// Data integrity check performed after every linear transformation. The multiset hash checks no byte
+// was lost or changed, the dot product also checks the position of every byte
+typedef enum { CHECK_NONE, CHECK_MULTISET, CHECK_DOT } integrity_mode;
+// Globals set from the initial arguments, defined in util.c
 // Max number of threads to use
-int num_threads;
+extern int num_threads;
+// Number of chunks a thread takes at a time when transforming, 0 to pick automatically
+extern long grain_size;
+// Bytes of file data held in memory at a time, 0 to read the whole file into memory
+extern long memory_budget;
+// Transform the file in place through a shared memory mapping, then rename it to the output name
+extern boolean in_place;
 // Print instructions as they are input
-boolean verbose_lvl_1;
+extern boolean verbose_lvl_1;
 // Print information for debugging
-boolean verbose_lvl_2;
+extern boolean verbose_lvl_2;
 
 /*
  * Contains global information from initial arguments. Can include first instruction.
@@ -25,10 +35,12 @@ typedef struct initial_state {
   // Permuation matrix dimmension, 0 if variable
   int dimension;
   boolean delete_when_done;
-  // Specifies whether to perform data integrity check after every linear transformation
-  boolean integrity_check;
+  // Specifies which data integrity check to perform after every linear transformation
+  integrity_mode integrity_check;
   // Specifies whether to enter instruction input loop for multiple passes
   boolean multilevel;
+  // Decrypt with the instructions given, then encrypt with new ones, in a single run
+  boolean rekey;
   char *encrypt_key;
   char *output_name;
 } initial_state;
@@ -40,8 +52,8 @@ typedef struct command {
   // Permuation matrix dimmension, 0 if variable
   int dimension;
   char *encrypt_key;
-  // Specifies whether to perform data integrity check after every linear transformation
-  boolean integrity_check;
+  // Specifies which data integrity check to perform after every linear transformation
+  integrity_mode integrity_check;
   // Specifies whether to remove last instruction
   boolean remove_last;
   boolean print_all;
@@ -53,18 +65,22 @@ void get_key(char *);
 void remove_newline(char *);
 void fatal(char *, char *);
 
-// Linked list -------------------------------------------------------------------------------------
-typedef struct node {
-  struct node *next;
-  struct node *last;
-  int number;
-} node;
+// Order statistic tree ----------------------------------------------------------------------------
 
-node **init_ll_trash(int);
-node *build_ll(node *, int);
-void remove_node(node **, node *);
-void empty_trash(node **, int);
-void free_ll_trash(node **);
+/*
+ * Fenwick tree over the indexes 0 to size - 1 which have not yet been pulled. Supports fetching and
+ * removing the index of a given rank in O(log n).
+ */
+typedef struct order_tree {
+  int size;
+  // Largest power of two less than or equal to size
+  int top_bit;
+  int tree[];
+} order_tree;
+
+order_tree *init_order_tree(int);
+int pull_index(order_tree *, int);
+void free_order_tree(order_tree *);
 
 // FontBlanc_C helpers -----------------------------------------------------------------------------
 char *get_extension(char *);